@@ -1,10 +1,13 @@
 // forwards packets from shared mem. to InfluxDB using UDP line protocol
-// run as ./fwd_influx [-f config_file]
+// run as ./fwd_influx [-f config_file]...
 // if config file not specified with -f option, uses the default location
+// -f can be given more than once to forward every vehicle from one process
 //
 // if there is a measurement called "UPTIME" it will be used as a timestamp
 // "UPTIME" is expected to be in units of milliseconds
 // otherwise the InfluxDB server clock will be used as the timestamp
+//
+// without a history ring only measurements that changed since the last send are forwarded
 
 #include <stdio.h>
 #include <string.h>
@@ -39,6 +42,34 @@ using namespace convert;
 int sockfd;
 unsigned char sock_open = 0;
 
+// everything needed to forward one vehicle
+typedef struct {
+    VCM* vcm;
+    Reader* reader;
+    size_t history_slots;
+    size_t max_packets;
+    unsigned char* buff;
+    packet_record_t* records;
+    std::vector<handle_t> changed; // measurements that changed, when not using the history ring
+    Decoder* decoder;
+    value_t* frame; // decoded measurements of one packet
+} vehicle_t;
+
+// size the read buffers for the vehicle's current layout
+void size_buffers(vehicle_t& vehicle) {
+    VCM* vcm = vehicle.vcm;
+
+    delete[] vehicle.buff;
+    vehicle.buff = new unsigned char[vcm->packet_size * vehicle.max_packets];
+    memset((void*)vehicle.buff, 0, vcm->packet_size * vehicle.max_packets); // zero the buffer
+
+    vehicle.changed.reserve(vcm->measurements.size());
+
+    vehicle.decoder->init(vcm);
+    delete[] vehicle.frame;
+    vehicle.frame = new value_t[vehicle.decoder->size()];
+}
+
 void sighandler(int signum) {
     if(sock_open) {
         close(sockfd);
@@ -52,7 +83,7 @@ int main(int argc, char* argv[]) {
 
     logger.log_message("starting database forwarding");
 
-    std::string config_file = "";
+    std::vector<std::string> config_files;
 
     for(int i = 1; i < argc; i++) {
         if(!strcmp(argv[i], "-f")) {
@@ -61,7 +92,7 @@ int main(int argc, char* argv[]) {
                 printf("Must specify a path to the config file after using the -f option\n");
                 return -1;
             } else {
-                config_file = argv[++i];
+                config_files.push_back(argv[++i]);
             }
         } else {
             std::string msg = "Invalid argument: ";
@@ -72,16 +103,33 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    VCM* vcm;
-    try {
-        if(config_file == "") {
-            vcm = new VCM(); // use default config file
-        } else {
-            vcm = new VCM(config_file); // use specified config file
+    if(config_files.size() == 0) {
+        config_files.push_back(""); // use default config file
+    }
+
+    if(config_files.size() > MAX_WAIT_READERS) {
+        logger.log_message("Too many config files");
+        printf("Too many config files, can forward at most %lu vehicles\n", MAX_WAIT_READERS);
+        return -1;
+    }
+
+    std::vector<vehicle_t> vehicles;
+    std::vector<Reader*> readers;
+
+    for(std::string config_file : config_files) {
+        vehicle_t vehicle;
+        try {
+            if(config_file == "") {
+                vehicle.vcm = new VCM(); // use default config file
+            } else {
+                vehicle.vcm = new VCM(config_file); // use specified config file
+            }
+        } catch (const std::runtime_error& e) {
+            std::cout << e.what() << '\n';
+            return FAILURE;
         }
-    } catch (const std::runtime_error& e) {
-        std::cout << e.what() << '\n';
-        return FAILURE;
+
+        vehicles.push_back(vehicle);
     }
 
     // add signal handlers to close the socket if opened
@@ -109,77 +157,152 @@ int main(int argc, char* argv[]) {
     servaddr.sin_addr.s_addr = inet_addr(INFLUXDB_ADDR);
 
     // attach to shmem
-    if(FAILURE == attach_to_shm(vcm)) {
-        logger.log_message("unable to attach fwd_influx process to shared memory");
-        printf("unable to attach fwd_influx process to shared memory\n");
-        return FAILURE;
+    for(vehicle_t& vehicle : vehicles) {
+        VCM* vcm = vehicle.vcm;
+
+        vehicle.reader = new Reader();
+        if(FAILURE == vehicle.reader->attach(vcm)) {
+            logger.log_message("unable to attach fwd_influx process to shared memory");
+            printf("unable to attach fwd_influx process to shared memory\n");
+            return FAILURE;
+        }
+        readers.push_back(vehicle.reader);
+
+        // if shared memory keeps a history of packets, forward every packet in it
+        // instead of sampling whatever is newest
+        vehicle.history_slots = vehicle.reader->get_history_slots();
+        vehicle.max_packets = vehicle.history_slots ? vehicle.history_slots : 1;
+
+        vehicle.buff = NULL;
+        vehicle.decoder = new Decoder();
+        vehicle.frame = NULL;
+        size_buffers(vehicle);
+        vehicle.records = new packet_record_t[vehicle.max_packets];
     }
 
-    unsigned char* buff = new unsigned char[vcm->packet_size];
-    memset((void*)buff, 0, vcm->packet_size); // zero the buffer
-
-    measurement_info_t* m_info;
-    // size_t addr = 0;
-
     std::string msg;
-    std::string val;
     // uint32_t timestamp = 0;
     // unsigned char use_timestamp = 0;
 
+    size_t count = 1;
+    size_t missed = 0;
+    size_t index = 0;
+
     // main loop
     while(1) {
-        // read from shared memoery
-        if(FAILURE == read_from_shm_block((void*)buff, vcm->packet_size)) {
-            logger.log_message("failed to read from shared memory");
-            // ignore and continue
+        // wait for any vehicle to write to shared memory
+        if(FAILURE == wait_any(readers, &index)) {
+            logger.log_message("failed to wait on shared memory");
+            continue;
         }
 
-        // construct the message
-        msg = vcm->device;
-        msg += " ";
-
-        unsigned char first = 1;
+        // other vehicles may have been updated too, check all of them
+        bool retry = false;
+        for(vehicle_t& vehicle : vehicles) {
+            VCM* vcm = vehicle.vcm;
+
+            // a new layout was published, pick it up before reading
+            if(vehicle.reader->layout_changed()) {
+                if(FAILURE == vehicle.reader->rebind()) {
+                    // rebind logged why, the config file may not be updated yet
+                    // wait_any returns right away until it succeeds, so back off before trying again
+                    retry = true;
+                    continue;
+                }
+                size_buffers(vehicle);
+                logger.log_message("switched to new layout for " + vcm->device);
+            }
 
-        for(std::string meas : vcm->measurements) {
-            m_info = vcm->get_info(meas);
-            //addr = (size_t)m_info->addr;
+            // read from shared memoery
+            if(vehicle.history_slots) {
+                if(FAILURE == vehicle.reader->read_history(vehicle.buff, vehicle.records,
+                                                           vehicle.max_packets, &count, &missed)) {
+                    continue; // nothing new
+                }
 
-            /**
-            if(meas == "UPTIME") {
-                if(SUCCESS == convert_uint(vcm, m_info, buff, &timestamp)) {
-                    use_timestamp = 1;
+                if(missed) {
+                    logger.log_message("missed " + std::to_string(missed) + " packets from " + vcm->device);
                 }
+            } else if(FAILURE == vehicle.reader->read_delta(vehicle.buff, vcm->packet_size, vehicle.changed)) {
+                continue; // nothing new
+            } else {
+                count = 1;
             }
-            **/
 
-            if(!first) {
-                msg += ",";
-            }
-            first &= 0;
+            size_t num_meas = vehicle.history_slots ? vcm->measurements.size() : vehicle.changed.size();
 
+            for(size_t i = 0; i < count; i++) {
+                unsigned char* packet = vehicle.buff + (i * vcm->packet_size);
 
-            if(SUCCESS == convert_str(vcm, m_info, buff, &val)) {
-                msg += meas;
-                msg += "=";
-                msg += val;
+                // decode everything that will be sent in one pass
+                if(vehicle.history_slots) {
+                    vehicle.decoder->decode(packet, vehicle.frame);
+                } else {
+                    vehicle.decoder->decode(packet, vehicle.frame, vehicle.changed);
+                }
+
+                // construct the message
+                msg = vcm->device;
+                msg += " ";
+
+                unsigned char first = 1;
+
+                for(size_t j = 0; j < num_meas; j++) {
+                    // every measurement of packets from the history, only what changed otherwise
+                    handle_t handle = vehicle.history_slots ? j : vehicle.changed[j];
+                    const std::string& meas = vcm->measurements[handle];
+
+                    /**
+                    if(meas == "UPTIME") {
+                        if(vehicle.frame[handle].kind == UINT_VALUE) {
+                            timestamp = vehicle.frame[handle].u;
+                            use_timestamp = 1;
+                        }
+                    }
+                    **/
+
+                    // measurements that can't be decoded are left out
+                    size_t start = msg.size();
+                    if(!first) {
+                        msg += ",";
+                    }
+                    msg += meas;
+                    msg += "=";
+
+                    if(SUCCESS == append(msg, &(vehicle.frame[handle]))) {
+                        first = 0;
+                    } else {
+                        msg.resize(start);
+                    }
+                }
+
+                // we can add a timestamp in nano-seconds to the end of the line in Influx line protocol
+                //if(use_timestamp) {
+                //    uint64_t nanosec_time = timestamp;
+                //    msg += std::to_string(nanosec_time * NANOSEC_PER_MILLISEC);
+                //}
+
+                // packets from the history ring know when they were written, use that as the timestamp
+                if(vehicle.history_slots) {
+                    msg += " ";
+                    msg += std::to_string(vehicle.records[i].timestamp);
+                }
+
+                // send the message
+                ssize_t sent = -1;
+                // std::cout << msg << "\n";
+                sent = sendto(sockfd, msg.c_str(), msg.length(), 0,
+                    (struct sockaddr*)&servaddr, sizeof(servaddr));
+                if(sent == -1) {
+                    logger.log_message("Failed to send UDP message");
+                    printf("Failed to send UDP message\n");
+                    // continue on
+                }
             }
         }
 
-        // we can add a timestamp in nano-seconds to the end of the line in Influx line protocol
-        //if(use_timestamp) {
-        //    uint64_t nanosec_time = timestamp;
-        //    msg += std::to_string(nanosec_time * NANOSEC_PER_MILLISEC);
-        //}
-
-        // send the message
-        ssize_t sent = -1;
-        // std::cout << msg << "\n";
-        sent = sendto(sockfd, msg.c_str(), msg.length(), 0,
-            (struct sockaddr*)&servaddr, sizeof(servaddr));
-        if(sent == -1) {
-            logger.log_message("Failed to send UDP message");
-            printf("Failed to send UDP message\n");
-            // continue on
+        if(retry) {
+            usleep(REBIND_RETRY_USEC);
         }
     }
 }
@@ -10,6 +10,7 @@
 #include "lib/dls/dls.h"
 #include "lib/convert/convert.h"
 #include "common/types.h"
+#include "spica_layout.h"
 
 // view telemetry memory live
 // run as printgps [-f path_to_config_file]
@@ -18,15 +19,30 @@
 // looks for measurements names GPS_LAT, GPS_LONG, and GPS_ALT
 // prints them to stdout separated by spaces in that order
 
-#define GPS_LAT "GPS_LAT"
-#define GPS_LONG "GPS_LONG"
-#define GPS_ALT "GPS_ALT"
+// when the config file matches the layout print_gps was built with (data/spica/config) the
+// measurements are read with the generated accessors, otherwise they're looked up and converted
+
+#define LAT_NAME "GPS_LAT"
+#define LONG_NAME "GPS_LONG"
+#define ALT_NAME "GPS_ALT"
 
 using namespace vcm;
 using namespace shm;
 using namespace dls;
 using namespace convert;
 
+// look up the GPS measurements, fails if any are missing
+RetType find_gps(VCM* vcm, measurement_info_t** lat, measurement_info_t** lon, measurement_info_t** alt) {
+    *lat = vcm->get_info(LAT_NAME);
+    *lon = vcm->get_info(LONG_NAME);
+    *alt = vcm->get_info(ALT_NAME);
+
+    if(!*lat || !*lon || !*alt) {
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
 int main(int argc, char* argv[]) {
     MsgLogger logger("print_gps");
 
@@ -64,20 +80,64 @@ int main(int argc, char* argv[]) {
         exit(-1);
     }
 
-    if(FAILURE == attach_to_shm(vcm)) {
+    Reader reader;
+    if(FAILURE == reader.attach(vcm)) {
         logger.log_message("unable to attach mem_view process to shared memory");
         printf("unable to attach mem_view process to shared memory\n");
         return FAILURE;
     }
 
-    unsigned char* buff = new unsigned char[vcm->packet_size];
-    memset((void*)buff, 0, vcm->packet_size); // zero the buffer
+    // only the GPS measurements are needed, so read them straight out of shared memory
+    View view;
+    RetType ret;
+
+    // the layout can change while running (shmctl -reload), so check again after rebinding
+    bool built_in = (SUCCESS == spica_v1::check(vcm));
+    if(built_in) {
+        float lat;
+        float lon;
+        float alt;
+
+        while(built_in) {
+            do {
+                if(FAILURE == reader.begin_view_block(&view)) {
+                    if(!reader.layout_changed()) {
+                        logger.log_message("failed to read from shared memory");
+                    }
+                    ret = FAILURE;
+                    break;
+                }
+
+                lat = spica_v1::GPS_LAT::get(view.data);
+                lon = spica_v1::GPS_LONG::get(view.data);
+                alt = spica_v1::GPS_ALT::get(view.data);
+                ret = SUCCESS;
+            } while(FAILURE == reader.end_view(&view));
+
+            if(FAILURE == ret) {
+                if(reader.layout_changed()) {
+                    if(SUCCESS == reader.rebind()) {
+                        built_in = (SUCCESS == spica_v1::check(vcm));
+                    } else {
+                        usleep(REBIND_RETRY_USEC); // rebind logged why, try again in a bit
+                    }
+                }
+                continue;
+            }
+
+            printf("%f %f %f\n", lat, lon, alt);
+
+            usleep(1000); // sleep for 1 ms
+        }
+    }
+
+    logger.log_message("config file doesn't match the built in layout, converting measurements at runtime");
 
-    measurement_info_t* lat_meas = vcm->get_info(GPS_LAT);
-    measurement_info_t* long_meas = vcm->get_info(GPS_LONG);
-    measurement_info_t* alt_meas = vcm->get_info(GPS_ALT);
+    measurement_info_t* lat_meas;
+    measurement_info_t* long_meas;
+    measurement_info_t* alt_meas;
 
-    if(!lat_meas || !long_meas || !alt_meas) {
+    if(FAILURE == find_gps(vcm, &lat_meas, &long_meas, &alt_meas)) {
         logger.log_message("Missing GPS measurement");
         exit(-1);
     }
@@ -87,22 +147,35 @@ int main(int argc, char* argv[]) {
     std::string alt;
 
     while(1) {
-        // read from shared memoery
-        if(FAILURE == read_from_shm_block((void*)buff, vcm->packet_size)) {
-            logger.log_message("failed to read from shared memory");
-            // ignore and continue
-            continue;
-        }
-
-        if(FAILURE == convert_str(vcm, lat_meas, buff, &lat)) {
-            continue;
-        }
-
-        if(FAILURE == convert_str(vcm, long_meas, buff, &lon)) {
-            continue;
-        }
+        do {
+            // read from shared memoery
+            if(FAILURE == reader.begin_view_block(&view)) {
+                if(!reader.layout_changed()) {
+                    logger.log_message("failed to read from shared memory");
+                }
+                ret = FAILURE;
+                break;
+            }
 
-        if(FAILURE == convert_str(vcm, alt_meas, buff, &alt)) {
+            ret = convert_str(vcm, lat_meas, view.data, &lat);
+            if(SUCCESS == ret) {
+                ret = convert_str(vcm, long_meas, view.data, &lon);
+            }
+            if(SUCCESS == ret) {
+                ret = convert_str(vcm, alt_meas, view.data, &alt);
+            }
+        } while(FAILURE == reader.end_view(&view));
+
+        if(FAILURE == ret) {
+            // a new layout was published, the measurements have to be looked up again
+            if(reader.layout_changed()) {
+                if(FAILURE == reader.rebind()) {
+                    usleep(REBIND_RETRY_USEC); // rebind logged why, try again in a bit
+                } else if(FAILURE == find_gps(vcm, &lat_meas, &long_meas, &alt_meas)) {
+                    logger.log_message("Missing GPS measurement");
+                    exit(-1);
+                }
+            }
             continue;
         }
 
@@ -79,8 +79,9 @@ int main(int argc, char* argv[]) {
     measurement_info_t* m_info;
     size_t addr = 0;
     while(1) {
-        for(std::string meas : vcm->measurements) {
-            m_info = vcm->get_info(meas);
+        for(handle_t handle = 0; handle < vcm->measurements.size(); handle++) {
+            const std::string& meas = vcm->measurements[handle];
+            m_info = vcm->get_info(handle);
             addr = (size_t)m_info->addr;
 
             printf("%s  ", meas.c_str());
@@ -99,6 +100,29 @@ int main(int argc, char* argv[]) {
 
         // read from shared memory
         if(FAILURE == read_from_shm_block((void*)buff, vcm->packet_size)) {
+            // a new layout was published, switch to it and start over with the new measurements
+            if(layout_changed()) {
+                if(FAILURE == rebind_shm()) {
+                    // rebind logged why, the config file may not be updated yet
+                    usleep(REBIND_RETRY_USEC);
+                    continue;
+                }
+
+                delete[] buff;
+                buff = new unsigned char[vcm->packet_size];
+                memset((void*)buff, 0, vcm->packet_size);
+
+                max_length = 0;
+                for(std::string it : vcm->measurements) {
+                    if(it.length() > max_length) {
+                        max_length = it.length();
+                    }
+                }
+
+                printf("\033[2J");
+                continue;
+            }
+
             logger.log_message("failed to read from shared memory");
             printf("failed to read from shared memory\n");
             // ignore and continue
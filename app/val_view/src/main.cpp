@@ -19,6 +19,23 @@ using namespace shm;
 using namespace dls;
 using namespace convert;
 
+// print a decoded measurement
+void print_value(value_t* value) {
+    char buff[MAX_NUMBER_TEXT];
+
+    if(value->kind == STRING_VALUE) {
+        printf("%.*s\n", (int)value->len, value->str);
+        return;
+    }
+
+    char* end = format(buff, buff + MAX_NUMBER_TEXT, value);
+    if(end) {
+        printf("%.*s\n", (int)(end - buff), buff);
+    } else {
+        printf("ERR\n");
+    }
+}
+
 int main(int argc, char* argv[]) {
     MsgLogger logger("val_view");
 
@@ -67,6 +84,11 @@ int main(int argc, char* argv[]) {
     unsigned char* buff = new unsigned char[vcm->packet_size];
     memset((void*)buff, 0, vcm->packet_size); // zero the buffer
 
+    // decode every measurement at once each time shared memory is read
+    Decoder decoder;
+    decoder.init(vcm);
+    value_t* frame = new value_t[decoder.size()];
+
     unsigned int max_length = 0;
     for(std::string it : vcm->measurements) {
         count++;
@@ -78,10 +100,11 @@ int main(int argc, char* argv[]) {
     // clear the screen
     printf("\033[2J");
 
-    measurement_info_t* m_info;
     while(1) {
-        for(std::string meas : vcm->measurements) {
-            m_info = vcm->get_info(meas);
+        decoder.decode(buff, frame);
+
+        for(handle_t handle = 0; handle < vcm->measurements.size(); handle++) {
+            const std::string& meas = vcm->measurements[handle];
 
             printf("%s  ", meas.c_str());
 
@@ -90,13 +113,38 @@ int main(int argc, char* argv[]) {
                 printf(" ");
             }
 
-            std::string data = "ERR";
-            convert_str(vcm, m_info, buff, &data);
-            std::cout << data << "\n";
+            print_value(&(frame[handle]));
         }
 
         // read from shared memoery
         if(FAILURE == read_from_shm_block((void*)buff, vcm->packet_size)) {
+            // a new layout was published, switch to it and start over with the new measurements
+            if(layout_changed()) {
+                if(FAILURE == rebind_shm()) {
+                    // rebind logged why, the config file may not be updated yet
+                    usleep(REBIND_RETRY_USEC);
+                    continue;
+                }
+
+                delete[] buff;
+                buff = new unsigned char[vcm->packet_size];
+                memset((void*)buff, 0, vcm->packet_size);
+
+                decoder.init(vcm);
+                delete[] frame;
+                frame = new value_t[decoder.size()];
+
+                max_length = 0;
+                for(std::string it : vcm->measurements) {
+                    if(it.length() > max_length) {
+                        max_length = it.length();
+                    }
+                }
+
+                printf("\033[2J");
+                continue;
+            }
+
             logger.log_message("failed to read from shared memory");
             printf("failed to read from shared memory\n");
             // ignore and continue
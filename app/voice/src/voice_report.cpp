@@ -138,15 +138,13 @@ int main(int argc, char* argv[]) {
         exit(-1);
     }
 
-    if(FAILURE == attach_to_shm(vcm)) {
+    Reader reader;
+    if(FAILURE == reader.attach(vcm)) {
         logger.log_message("unable to attach mem_view process to shared memory");
         printf("unable to attach mem_view process to shared memory\n");
         return FAILURE;
     }
 
-    unsigned char* buff = new unsigned char[vcm->packet_size];
-    memset((void*)buff, 0, vcm->packet_size); // zero the buffer
-
     // measurement_info_t* lat_meas = vcm->get_info(LAT);
     // measurement_info_t* long_meas = vcm->get_info(LONG);
     measurement_info_t* lat_meas = vcm->get_info(ALT);
@@ -173,40 +171,54 @@ int main(int argc, char* argv[]) {
     float last_alt = 0;
     int started = 0; // if we've left the pad
 
-    clock_t t;
-    t = clock();
-    clock_t elapsed;
+    // only a few measurements are needed, so read them straight out of shared memory
+    View view;
+    RetType ret;
 
     while(1) {
-        // read from shared memoery
-        if(FAILURE == read_from_shm_if_updated((void*)buff, vcm->packet_size)) {
-            if(started) {
-                // only check fot timeout if we've gotten any packets, dont want to prematurely report
-                elapsed = clock() - t;
-                if((((double)elapsed) / CLOCKS_PER_SEC) > LOCATION_TIMEOUT) {
-                    report_loc(lat, lon, alt);
-                    t = clock();
+        // only time out if we've gotten any packets, dont want to prematurely report
+        int timeout = started ? LOCATION_TIMEOUT * 1000 : -1;
+
+        // sleep until shared memory is written or we time out
+        if(FAILURE == reader.wait(timeout)) {
+            report_loc(lat, lon, alt);
+            continue;
+        }
+
+        if(FAILURE == reader.begin_view_if_updated(&view)) {
+            // a new layout was published, the measurements have to be looked up again
+            if(reader.layout_changed()) {
+                if(FAILURE == reader.rebind()) {
+                    usleep(REBIND_RETRY_USEC); // rebind logged why, try again in a bit
+                    continue;
+                }
+
+                lat_meas = vcm->get_info(ALT);
+                long_meas = vcm->get_info(ALT);
+                alt_meas = vcm->get_info(ALT);
+
+                if(!lat_meas || !long_meas || !alt_meas) {
+                    logger.log_message("Missing measurement");
+                    exit(-1);
                 }
             }
             continue;
-        } else {
-            // if we've gotten any packet, we've taken off
-            // TODO maybe check for leaving the pad?
-            started = 1;
-
-            // restart the clock
-            t = clock();
         }
 
-        if(FAILURE == convert_float(vcm, lat_meas, buff, &lat)) {
-            // continue;
-        }
+        // if we've gotten any packet, we've taken off
+        // TODO maybe check for leaving the pad?
+        started = 1;
+
+        convert_float(vcm, lat_meas, view.data, &lat); // don't care if this fails
+        convert_float(vcm, long_meas, view.data, &lon); // don't care if this fails
+        ret = convert_float(vcm, alt_meas, view.data, &alt);
 
-        if(FAILURE == convert_float(vcm, long_meas, buff, &lon)) {
-            // continue;
+        if(FAILURE == reader.end_view(&view)) {
+            // packet changed while reading it, try again
+            continue;
         }
 
-        if(FAILURE == convert_float(vcm, alt_meas, buff, &alt)) {
+        if(FAILURE == ret) {
             continue;
         }
 
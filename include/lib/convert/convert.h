@@ -6,16 +6,277 @@
 #include "common/types.h"
 #include "lib/vcm/vcm.h"
 #include <stdint.h>
+#include <string.h>
 #include <string>
+#include <vector>
+#include <limits>
+#include <type_traits>
 
-// can't convert any measurement larger than this
-#define MAX_CONVERSION_SIZE 256 // bytes
+// longest text format writes for a number, strings can be longer
+#define MAX_NUMBER_TEXT 32 // characters
 
 namespace convert {
+    // raw bits of an integer or floating point measurement up to 8 bytes, with padding removed
+    // signed integers are sign extended to 64 bits, floats are left as their bits
+    // the convert_* functions below all decode through this, so padded and bit packed measurements just work
+    RetType extract(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, uint64_t* dst);
+    // reentrant, but allocates if 'dst' is too small, use decode and format in hot loops
     RetType convert_str(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, std::string* dst);
+    // same as convert<uint32_t>, convert<int32_t>, and convert<float> below, but log why they fail
     RetType convert_uint(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, uint32_t* dst);
     RetType convert_int(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, int32_t* dst);
     RetType convert_float(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, float* dst);
+
+    // compute every derived measurement (see vcm::derive_op_t) from 'packet' and store them in it
+    // 'packet' is laid out the same as shared memory, vcm->packet_size bytes
+    RetType derive(vcm::VCM* vcm, unsigned char* packet);
+
+    // what a measurement decodes to
+    typedef enum {
+        INT_VALUE, UINT_VALUE, FLOAT_VALUE, DOUBLE_VALUE, STRING_VALUE,
+        NO_VALUE // can't be decoded, e.g. an undefined type or an integer over 8 bytes
+    } value_kind_t;
+
+    // one decoded measurement
+    typedef struct {
+        value_kind_t kind;
+        union {
+            int64_t i;
+            uint64_t u;
+            float f;
+            double d;
+            const char* str; // points into the decoded packet, not null terminated
+        };
+        size_t len; // bytes in 'str', up to the first null
+    } value_t;
+
+    // decode one measurement, fails if it can't be decoded (see Decoder to decode a whole packet)
+    RetType decode(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, value_t* dst);
+
+    // how to decode one measurement, worked out once by plan so decoding it is only a load, a shift,
+    // and a mask
+    typedef struct {
+        uint32_t addr; // first byte
+        uint32_t size; // bytes
+        value_kind_t kind;
+        uint8_t bits; // width of the value
+        uint8_t shift; // right shift of the loaded word that lines the value up at bit 0
+        uint8_t extend; // left shift that puts the value's sign bit at the top, 0 if unsigned or 64 bits
+        bool swap; // shared memory isn't in the system's endianness
+        bool tail; // too close to the end of the packet to load 8 bytes
+        uint64_t mask;
+    } field_t;
+
+    // work out how to decode 'measurement', sets the field's kind to NO_VALUE if it can't be decoded
+    void plan(vcm::VCM* vcm, vcm::measurement_info_t* measurement, field_t* field);
+
+    // raw bits of a planned integer or floating point field, same as extract but without any checks
+    // 'swap' overrides the field's, for callers that know it for a whole packet
+    inline uint64_t load(const field_t* field, const void* packet, bool swap) {
+        const unsigned char* buff = (const unsigned char*)packet + field->addr;
+
+        // only the last few measurements in a packet need to be copied into a word first
+        unsigned char tail[sizeof(uint64_t)];
+        if(field->tail) {
+            memset(tail, 0, sizeof(uint64_t));
+            memcpy(tail, buff, field->size);
+            buff = tail;
+        }
+
+        uint64_t word;
+        memcpy(&word, buff, sizeof(uint64_t));
+        if(swap) {
+            word = __builtin_bswap64(word);
+        }
+
+        word = (word >> field->shift) & field->mask;
+        if(field->extend) {
+            word = (uint64_t)((int64_t)(word << field->extend) >> field->extend);
+        }
+        return word;
+    }
+
+    inline uint64_t load(const field_t* field, const void* packet) {
+        return load(field, packet, field->swap);
+    }
+
+    // true if every value of 'field' converts to T exactly
+    // integers need enough bits (a signed T can't hold a negative value's unsigned bits), floats can
+    // be held by any floating point type at least as wide, and integers by a floating point type
+    // with enough mantissa bits
+    template <typename T>
+    inline bool fits(const field_t* field) {
+        static_assert(std::is_arithmetic<T>::value, "can only convert to numbers");
+
+        const size_t digits = std::numeric_limits<T>::digits; // bits of magnitude
+
+        switch(field->kind) {
+            case INT_VALUE:
+                return std::numeric_limits<T>::is_signed && (size_t)(field->bits - 1) <= digits;
+            case UINT_VALUE:
+                return field->bits <= digits;
+            case FLOAT_VALUE:
+                return std::is_floating_point<T>::value;
+            case DOUBLE_VALUE:
+                return std::is_floating_point<T>::value && sizeof(T) >= sizeof(double);
+            default:
+                return false;
+        }
+    }
+
+    // converts one measurement to T, with the measurement's checks and the choice of how to convert
+    // it made once when it's built
+    // works for every integer type from int8_t to uint64_t, float, and double
+    template <typename T>
+    class Converter {
+    public:
+        Converter(): convert_field(&from_uint) {
+            memset(&field, 0, sizeof(field_t));
+        }
+
+        // returns failure if the measurement's values don't always convert to T exactly (see fits)
+        RetType init(vcm::VCM* vcm, vcm::measurement_info_t* measurement) {
+            plan(vcm, measurement, &field);
+
+            // picked here so get doesn't have to look at the kind
+            switch(field.kind) {
+                case INT_VALUE:
+                    convert_field = &from_int;
+                    break;
+                case FLOAT_VALUE:
+                    convert_field = &from_float;
+                    break;
+                case DOUBLE_VALUE:
+                    convert_field = &from_double;
+                    break;
+                default:
+                    convert_field = &from_uint;
+                    break;
+            }
+
+            return fits<T>(&field) ? SUCCESS : FAILURE;
+        }
+
+        // convert the measurement in 'packet', only call after init succeeds
+        T get(const void* packet) const {
+            return convert_field(&field, packet);
+        }
+    private:
+        static T from_int(const field_t* field, const void* packet) {
+            return (T)(int64_t)load(field, packet);
+        }
+
+        static T from_uint(const field_t* field, const void* packet) {
+            return (T)load(field, packet);
+        }
+
+        static T from_float(const field_t* field, const void* packet) {
+            uint32_t val32 = (uint32_t)load(field, packet);
+            float val;
+            memcpy(&val, &val32, sizeof(float));
+            return (T)val;
+        }
+
+        static T from_double(const field_t* field, const void* packet) {
+            uint64_t word = load(field, packet);
+            double val;
+            memcpy(&val, &word, sizeof(double));
+            return (T)val;
+        }
+
+        field_t field;
+        T (*convert_field)(const field_t* field, const void* packet); // load and convert for the field's kind
+    };
+
+    // convert one measurement to T, checking it every call
+    // build a Converter once instead when converting the same measurement over and over
+    template <typename T>
+    RetType convert(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, T* dst) {
+        Converter<T> converter;
+        if(FAILURE == converter.init(vcm, measurement)) {
+            return FAILURE;
+        }
+
+        *dst = converter.get(data);
+        return SUCCESS;
+    }
+
+    // write a value as text from 'dst' up to 'end', without a null terminator
+    // integers in base 10 and floats as the shortest text that reads back as the same value
+    // (compilers without std::to_chars for floats write 9 or 17 significant digits instead)
+    // returns the end of the text, or NULL if it doesn't fit or there's no value
+    // never allocates and doesn't touch anything but 'dst', so it's safe to call from any thread
+    char* format(char* dst, char* end, const value_t* value);
+
+    // add a value as text to the end of 'dst', only allocates if 'dst' has to grow
+    // returns failure if there's no value
+    RetType append(std::string& dst, const value_t* value);
+
+    // decodes every measurement in a packet in one pass into a frame of values, one per measurement
+    // in handle order
+    // every measurement is checked once when the decoder is built, decoding a packet is only loads,
+    // shifts, and masks with nothing logged
+    class Decoder {
+    public:
+        Decoder();
+
+        // build the decoder for 'vcm', build it again whenever the layout changes (e.g. after rebinding)
+        RetType init(vcm::VCM* vcm);
+
+        // decode every measurement in 'packet' (vcm->packet_size bytes) into 'frame' (size() values)
+        void decode(const void* packet, value_t* frame);
+
+        // only decode 'handles', each into frame[handle]
+        void decode(const void* packet, value_t* frame, const std::vector<vcm::handle_t>& handles);
+
+        // values in a frame
+        size_t size() {
+            return fields.size();
+        }
+    private:
+        template <bool SWAP>
+        void decode_field(const unsigned char* packet, const field_t* field, value_t* value);
+
+        bool swap; // shared memory isn't in the system's endianness
+        std::vector<field_t> fields; // indexed by handle
+    };
+
+    // swaps received measurements to the endianness of shared memory (see vcm::VCM::shm_endianness)
+    // done once in decom so readers never swap
+    // measurements are swapped in chunks of up to 16 bytes, each one shuffle with SSSE3 or a byte
+    // loop without it
+    class Swapper {
+    public:
+        Swapper();
+
+        // build the swapper for 'vcm', build it again whenever the layout changes (e.g. after rebinding)
+        RetType init(vcm::VCM* vcm);
+
+        // true if received measurements have to be swapped at all
+        bool needed() {
+            return chunks.size() > 0;
+        }
+
+        // swap the measurements a received packet of 'type' (NULL without packet types) wrote to
+        // 'packet', which is laid out the same as shared memory (see vcm::VCM::unpack)
+        void swap_packet(unsigned char* packet, vcm::packet_type_t* type);
+
+        // swap the measurements from byte 'start' up to 'end' of 'packet'
+        void swap(unsigned char* packet, size_t start, size_t end);
+    private:
+        // measurements next to each other are swapped together
+        typedef struct {
+            uint32_t offset; // first byte
+            uint32_t size; // bytes, at most 16
+            unsigned char shuffle[16]; // byte i of the chunk comes from byte shuffle[i]
+        } chunk_t;
+
+        size_t packet_size;
+        size_t header_size;
+        size_t recv_size;
+        bool simd; // the CPU has SSSE3
+        std::vector<chunk_t> chunks; // in order of offset
+    };
 }
 
 #endif
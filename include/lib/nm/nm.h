@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <mqueue.h>
 #include <string>
@@ -12,13 +13,32 @@
 namespace nm {
 
     static const size_t MAX_Q_SIZE = 2048;
+    static const size_t MAX_MSG_SIZE = 4096; // largest message sent or received, bigger ones are truncated
+    static const size_t MAX_BATCH_SIZE = 32; // most datagrams received at once by ReceiveBatch
+
+    // datagrams received by one call to ReceiveBatch, in the order they arrived
+    // the data belongs to the network manager and is only valid until the next receive
+    typedef struct {
+        size_t count;
+        char* data[MAX_BATCH_SIZE];
+        size_t size[MAX_BATCH_SIZE]; // set to MAX_MSG_SIZE if the datagram was truncated
+    } batch_t;
+
+    // how the network manager receives datagrams
+    typedef enum {
+        SOCKET_BACKEND, // recvfrom and recvmmsg on the socket
+        URING_BACKEND // io_uring with buffers provided to the kernel (see lib/nm/uring.h), needs Linux 6.0
+    } backend_t;
+
+    class URing;
 
     // checks an mqueue of name /[device_name from VCM] for messages to send over UDP
     // checks the UDP socket for incoming messages and writes them to shared memory
     // should only have ONE of these per vehicle (per vcm file)
     class NetworkManager {
     public:
-        NetworkManager(vcm::VCM* vcm);
+        // the io_uring backend falls back to the socket when Open finds the kernel can't do it
+        NetworkManager(vcm::VCM* vcm, backend_t backend = SOCKET_BACKEND);
         ~NetworkManager();
         RetType Open();
         RetType Close(); // returns fail if anything goes wrong
@@ -26,7 +46,18 @@ namespace nm {
         RetType Send(); // send any outgoing messages from the mqueue, return FAILURE on error
         RetType Receive(); // receive any messages and write them to in_buffer, return FAILURE if nothing was received (or error)
 
-        char* in_buffer;
+        // receive every waiting datagram (up to MAX_BATCH_SIZE) with one system call
+        // return FAILURE if nothing was received (or error)
+        RetType ReceiveBatch(batch_t* batch);
+
+        // descriptors to wait on (with poll or epoll) until there's something to receive or send
+        // only valid while open
+        int ReceiveFd(); // the socket, or the ring with the io_uring backend
+        int QueueFd(); // mqueue descriptors can be polled on Linux
+
+        backend_t backend; // the backend in use, only final after Open
+
+        char* in_buffer; // MAX_MSG_SIZE bytes
         size_t in_size;
 
         // TODO consider adding priority to sending some messages (like deployment)
@@ -40,6 +71,14 @@ namespace nm {
 
         char* buffer;
         bool open;
+
+        URing* ring; // only with the io_uring backend, outgoing messages still go out the socket
+
+        // every datagram in a batch gets its own MAX_MSG_SIZE buffer in the pool
+        char* pool;
+        struct mmsghdr batch_msgs[MAX_BATCH_SIZE];
+        struct iovec batch_iovs[MAX_BATCH_SIZE];
+        struct sockaddr_in batch_addrs[MAX_BATCH_SIZE];
     };
 
     // allows a process to queue a message to send
@@ -0,0 +1,86 @@
+/********************************************************************
+*  Name: uring.h
+*
+*  Purpose: Minimal io_uring used by the network manager to receive
+*           datagrams without a system call per packet.
+*
+*  RIT Launch Initiative
+*********************************************************************/
+#ifndef NM_URING_H
+#define NM_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "common/types.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+namespace nm {
+
+    static const size_t URING_BUFFERS = 64; // datagrams the kernel can receive before we collect them, a power of 2
+
+    // set up with the raw system calls so there's no dependency on liburing
+    // keeps one multishot recvmsg armed on a UDP socket with a ring of buffers provided to the kernel,
+    // every datagram that arrives is received into the next free buffer and shows up as a completion
+    // that's collected from shared memory without a system call
+    // needs Linux 6.0 or newer, Open fails on anything older so the caller can fall back to the socket
+    class URing {
+    public:
+        URing();
+        ~URing();
+
+        // start receiving datagrams of up to 'size' bytes from 'sockfd'
+        // FAILURE if the kernel doesn't support everything needed (or error)
+        RetType Open(int sockfd, size_t size);
+        void Close();
+
+        // readable (with poll or epoll) when there are datagrams to collect
+        int Fd();
+
+        // collect up to 'max' received datagrams, sizes are capped at the size passed to Open
+        // 'from' is set to the sender of the last one
+        // the buffers are lent to the caller until the next call
+        // returns how many were collected
+        size_t Receive(char** data, size_t* sizes, size_t max, struct sockaddr_in* from);
+    private:
+        RetType Arm(); // submit the multishot recvmsg
+        void Provide(uint16_t* bids, size_t n); // give buffers (back) to the kernel
+
+        int ring_fd;
+        int sockfd;
+        size_t size;
+
+        // submission queue
+        void* sq_ptr;
+        size_t sq_len;
+        unsigned* sq_tail;
+        unsigned* sq_mask;
+        unsigned* sq_array;
+        struct io_uring_sqe* sqes;
+        size_t sqes_len;
+
+        // completion queue, shares the submission queue's mapping on most kernels
+        void* cq_ptr;
+        size_t cq_len;
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        unsigned* cq_mask;
+        struct io_uring_cqe* cqes;
+
+        // every buffer holds the kernel's recvmsg header, the sender's address, then the datagram
+        struct io_uring_buf_ring* bufs;
+        size_t bufs_len;
+        unsigned char* pool;
+        size_t slot_size;
+        struct msghdr msg; // tells the kernel how much room to leave for the address
+
+        uint16_t lent[URING_BUFFERS]; // buffer ids handed out by the last Receive
+        size_t num_lent;
+    };
+}
+
+#endif
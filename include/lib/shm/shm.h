@@ -8,8 +8,17 @@
 *
 *  RIT Launch Initiative
 *********************************************************************/
+#ifndef SHM_H
+#define SHM_H
+
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <semaphore.h>
+#include <time.h>
+#include <vector>
+#include <map>
+#include <thread>
 #include "lib/vcm/vcm.h"
 #include "common/types.h"
 
@@ -18,11 +27,446 @@ namespace shm {
     const int id = 65; // random number
     const int info_id = 23;
 
+    // max number of readers wait_any can wait on
+    const size_t MAX_WAIT_READERS = 128;
+
+    // how long to wait before trying to rebind again after it fails, reads keep failing until then
+    // so without waiting a reader would spin until the config file is edited
+    const unsigned int REBIND_RETRY_USEC = 500000;
+
+    // longest a writer waits on a lock before giving up on a write, in milliseconds
+    // in LOCK_MODE that's readers (and views), in SEQLOCK_MODE other writers
+    const long WRITE_TIMEOUT = 100;
+
+    // measurements are split into this many groups for waking up subscribed readers
+    // the measurement with handle i is in group i % WAKE_GROUPS
+    const size_t WAKE_GROUPS = 32;
+
+    // longest device name kept in shared memory to check attachments against, longer names are cut off
+    const size_t MAX_DEVICE_NAME = 64;
+
+    // attachments that can have their locks recovered if their process dies (see Segment::recover)
+    // more can attach, but their locks can't be recovered
+    const size_t MAX_LOCK_HOLDERS = 64;
+
+    // locks an attachment holds, recorded right after taking them and cleared right before giving them back
+    const uint32_t HELD_RMUTEX = 0x01;
+    const uint32_t HELD_WMUTEX = 0x02;
+    const uint32_t HELD_READTRY = 0x04; // while entering as a reader
+    const uint32_t HELD_RESOURCE = 0x08; // as the writer
+    const uint32_t HELD_READER = 0x10; // counted in readers, the readers hold resource together
+    const uint32_t HELD_WRITER = 0x20; // counted in writers, the writers hold readTry together
+
+    // an attachment that can hold locks, and the process it's in
+    typedef struct {
+        int32_t pid; // 0 if unused
+        uint32_t held; // HELD_* locks, only changed by the attachment (or by recover once its process is dead)
+    } lock_holder_t;
+
+    // locking mode of the shared memory, selected when it is created
+    // LOCK_MODE uses writers-preference reader/writer semaphores, if a reader dies while
+    // holding them writes time out and fail until the locks are recovered
+    // SEQLOCK_MODE lets readers copy without taking any lock and retry if a write
+    // happened during their copy, writers never wait on readers so a reader dying can't stall them
+    typedef enum {
+        LOCK_MODE, SEQLOCK_MODE
+    } shm_mode_t;
+
+    // options for creating and attaching to shared memory, can be or'd together
+    // when creating, every option but the backend is remembered and used by every process that attaches
+    const int SHM_OPT_SYSV = 0x01; // System V shared memory (default when creating)
+    const int SHM_OPT_POSIX = 0x02; // POSIX shared memory (shm_open/mmap), shows up under /dev/shm
+    const int SHM_OPT_HUGEPAGES = 0x04; // back with huge pages (POSIX needs hugetlbfs mounted at /dev/hugepages)
+    const int SHM_OPT_POPULATE = 0x08; // fault in every page when attaching
+    const int SHM_OPT_MLOCK = 0x10; // lock pages in memory so they're never paged out
+
+    // record of a packet read from the history ring
+    typedef struct {
+        uint64_t seq; // sequence number, increases by one for every packet written
+        uint64_t timestamp; // nanoseconds since epoch when the packet was written to shared memory
+    } packet_record_t;
+
+    // info block for locking shared memory, lives in its own shared memory block
+    typedef struct {
+        uint32_t nonce;
+        uint32_t generation; // bumped every time a new layout is published (see Writer::publish)
+        uint64_t layout_hash; // VCM::layout_hash() of the published layout
+        uint64_t layout_history_seq; // history_seq when the layout was published, older packets are in an older layout
+        uint64_t packet_capacity; // bytes set aside for a packet, a new layout's packet can't be any larger
+        uint64_t meas_capacity; // measurements set aside for, a new layout can't have any more
+        uint32_t seq; // seqlock sequence number, odd while a write is in progress
+        uint32_t mode; // shm_mode_t
+        uint32_t history_slots; // number of packets kept in the history ring (0 if disabled)
+        uint64_t history_seq; // sequence number of the newest packet in the history ring
+        uint64_t write_seq; // number of writes, each measurement remembers the last write that touched it
+        uint32_t options; // SHM_OPT_* options every process uses when attaching
+        uint32_t group_nonce[WAKE_GROUPS]; // nonce of the last write to each wake group
+        unsigned int readers;
+        unsigned int writers;
+        sem_t rmutex;
+        sem_t wmutex;
+        sem_t readTry;
+        sem_t resource;
+        lock_holder_t holders[MAX_LOCK_HOLDERS];
+        char device[MAX_DEVICE_NAME]; // device it was created for, System V keys of two devices can be the same
+    } shm_info_t;
+
+    // an attachment to the shared memory of a vehicle
+    // the VCM passed to attach must outlive the attachment
+    // a single attachment should not be used by more than one thread at a time
+    class Segment {
+    public:
+        Segment();
+        ~Segment();
+
+        // attach to the shared memory created for 'vcm'
+        // if neither SHM_OPT_SYSV or SHM_OPT_POSIX is given, uses whichever was created
+        RetType attach(vcm::VCM* vcm, int options = 0);
+
+        // detach from the shared memory, called automatically on destruction
+        RetType detach();
+
+        // mark the shared memory to be destroyed once every process detaches
+        RetType destroy();
+
+        // get the size of a packet
+        // this changes when rebinding to a new layout, so anything sized by it should be resized
+        size_t get_size();
+
+        // true if a new layout was published since this attachment last bound to one
+        // reads and writes fail until rebind is called
+        bool layout_changed();
+
+        // switch to the layout published in shared memory
+        // reloads the VCM this attachment was made with from its config file, so every
+        // measurement_info_t pointer and handle from that VCM has to be looked up again
+        // the VCM is left alone if its config file doesn't match the published layout (yet)
+        // after failing, it fails right away without logging until the config file is edited or
+        // another layout is published, callers should still wait REBIND_RETRY_USEC between tries
+        // a VCM shared by attachments in other threads must not be used by them while rebinding
+        RetType rebind();
+
+        // get the number of packets kept in the history ring (0 if there is no history)
+        size_t get_history_slots();
+
+        // get the generation of the layout published in shared memory (0 if not attached)
+        uint32_t get_generation();
+
+        // release locks held by a process that died while holding them
+        // every attachment records the locks it holds, only locks recorded by a process that
+        // no longer exists are released, so it's safe to use while other processes are running
+        // a process that dies right between taking a lock and recording it (or after attaching
+        // past MAX_LOCK_HOLDERS) can't be told apart from a live one, shared memory has to be
+        // recreated then
+        // recovered is set if any locks had to be released
+        RetType recover(bool* recovered);
+
+        bool attached;
+    protected:
+        vcm::VCM* vcm;
+        shm_info_t* info;
+        unsigned char* shmem;
+        uint64_t* meas_seq; // write_seq of the last write to each measurement, lives in shmem
+        int info_shmid;
+        int shmid;
+        bool posix;
+        size_t info_size;
+        size_t shmem_size;
+        uint32_t generation; // layout generation the VCM matches
+        bool bound; // false if the VCM doesn't match any published layout
+
+        // the last layout rebinding failed for, and the config file's modification time then
+        bool failed;
+        uint32_t failed_generation;
+        struct timespec failed_mtime;
+
+        // true if the layout changed since the VCM was bound, anything read or written since is wrong
+        bool stale() {
+            return !bound || __atomic_load_n(&(info->generation), __ATOMIC_ACQUIRE) != generation;
+        }
+
+        // this attachment's entry in info->holders, NULL if there wasn't a free one
+        lock_holder_t* holder;
+
+        // record taking or giving back locks (HELD_*)
+        void hold(uint32_t locks) {
+            if(holder) {
+                __atomic_store_n(&(holder->held), holder->held | locks, __ATOMIC_RELEASE);
+            }
+        }
+
+        void unhold(uint32_t locks) {
+            if(holder) {
+                __atomic_store_n(&(holder->held), holder->held & ~locks, __ATOMIC_RELEASE);
+            }
+        }
+    private:
+        RetType attach_sysv();
+        RetType attach_posix();
+        void claim_holder();
+        void release_holder();
+        RetType release_dead(lock_holder_t* dead);
+    };
+
+    // writes to the shared memory of a vehicle
+    class Writer : public Segment {
+    public:
+        // attach to the shared memory created for 'vcm'
+        RetType attach(vcm::VCM* vcm, int options = 0);
+
+        // switch to the layout published in shared memory, see Segment::rebind
+        RetType rebind();
+
+        // write to shared memory
+        // returns failure if not all bytes were able to be written
+        // never blocks longer than about twice WRITE_TIMEOUT, in SEQLOCK_MODE a writer that died in the
+        // middle of a write is recovered from (see Segment::recover), otherwise the write is dropped
+        RetType write(void* src, size_t size, size_t offset = 0);
+
+        // write the measurements from a received packet of 'type' (NULL without packet types)
+        // 'packet' is laid out the same as shared memory (see vcm::VCM::unpack), with packet types only
+        // the header and the type's measurements are written
+        // if 'derived' is true the derived measurements (see convert::derive) in 'packet' are written too
+        RetType write_packet(const unsigned char* packet, vcm::packet_type_t* type, bool derived = false);
+
+        // set all shared memory to zero
+        RetType clear();
+
+        // publish the layout of the VCM this writer was attached with, e.g. after its config file
+        // was edited and reloaded (see VCM::reload)
+        // the packet, measurement write sequence numbers, and history are cleared, and every
+        // other attachment sees layout_changed until it rebinds
+        // fails if the new layout doesn't fit in the capacity set aside when the shared memory was created
+        RetType publish();
+    private:
+        // 'size' bytes from 'src' go to 'offset' in the packet
+        typedef struct {
+            const void* src;
+            size_t size;
+            size_t offset;
+        } range_t;
+
+        // the measurements a range of the packet overlaps, and the wake groups they're in
+        typedef struct {
+            std::vector<vcm::handle_t> handles;
+            uint32_t groups;
+        } coverage_t;
+
+        RetType write_ranges(const range_t* ranges, size_t n);
+        uint32_t copy_ranges(const range_t* ranges, size_t n);
+        RetType lock();
+        RetType unlock();
+        RetType seq_lock();
+        uint32_t mark_written(size_t size, size_t offset);
+        void record_history();
+        void swap_layout();
+        void index_ranges();
+        coverage_t* cover(size_t size, size_t offset);
+
+        // coverage of every range written so far, by (offset, size)
+        // the ranges write_packet and clear use are worked out when attaching or switching layouts
+        std::map<std::pair<size_t, size_t>, coverage_t> coverage;
+        coverage_t uncached; // for ranges past MAX_COVERAGE
+    };
+
+    // read-only view of the packet in shared memory, opened and closed by a Reader
+    // nothing is copied out of shared memory until a measurement is read from the view
+    class View {
+    public:
+        View();
+
+        // start of the packet in shared memory
+        // only valid between Reader::begin_view* and Reader::end_view
+        const unsigned char* data;
+
+        // get a pointer to a measurement in shared memory
+        const void* get(vcm::measurement_info_t* measurement) {
+            return data + (size_t)measurement->addr;
+        }
+
+        // copy a measurement into 'dst', swapping bytes if shared memory isn't in the system endianness
+        // returns failure if the measurement isn't the size of T
+        template <typename T>
+        RetType get(vcm::measurement_info_t* measurement, T* dst) {
+            if(measurement->size != sizeof(T)) {
+                return FAILURE;
+            }
+
+            const unsigned char* src = data + (size_t)measurement->addr;
+            if(vcm->shm_endianness != vcm->sys_endianness) {
+                unsigned char val[sizeof(T)];
+                for(size_t i = 0; i < sizeof(T); i++) {
+                    val[sizeof(T) - i - 1] = src[i];
+                }
+                memcpy(dst, val, sizeof(T));
+            } else {
+                memcpy(dst, src, sizeof(T));
+            }
+
+            return SUCCESS;
+        }
+    private:
+        friend class Reader;
+
+        vcm::VCM* vcm;
+        uint32_t seq; // seqlock sequence number when the view was opened
+        uint32_t last_nonce; // reader nonce before the view was opened
+    };
+
+    class Reader;
+
+    // blocks until any of 'readers' has a write it hasn't read yet
+    // index is set to the first reader with an update, others may have updates as well
+    // readers can be attached to different vehicles
+    // on kernels without futex_waitv (older than 5.16) this polls each reader's get_fd, which
+    // starts a thread per reader, the fds shouldn't be read by anything else then
+    RetType wait_any(std::vector<Reader*>& readers, size_t* index);
+
+    // reads from the shared memory of a vehicle
+    // each reader keeps track of what it has already read, so threads in the same process
+    // can each have their own reader without stealing each other's updates
+    class Reader : public Segment {
+    public:
+        Reader();
+        ~Reader();
+
+        // attach to the shared memory created for 'vcm'
+        // only packets written to the history ring after attaching are considered new
+        RetType attach(vcm::VCM* vcm, int options = 0);
+
+        // read from shared memory, size is max size to read
+        // doesn't care how recent the read was
+        // returns failure if not all bytes were able to be read
+        RetType read(void* dst, size_t size, size_t offset = 0);
+
+        // detach from the shared memory, called automatically on destruction
+        RetType detach();
+
+        // switch to the layout published in shared memory, see Segment::rebind
+        // subscriptions carry over to the new layout by name
+        RetType rebind();
+
+        // only consider writes to these measurements (names from the VCM)
+        // once subscribed, updated, wait, get_fd, and every *_if_updated and *_block read
+        // ignore writes that didn't touch a subscribed measurement, so waiting readers aren't
+        // woken for nothing
+        // measurements are grouped, a write to another measurement in the same group (see
+        // WAKE_GROUPS) is treated as a write to a subscribed measurement
+        RetType subscribe(std::vector<std::string>& measurements);
+
+        // consider every write again
+        void unsubscribe();
+
+        // true if there has been a write since the last read
+        bool updated();
+
+        // blocks until there has been a write since the last read
+        // timeout is in milliseconds, -1 waits forever
+        // returns failure if the timeout expires first
+        RetType wait(int timeout = -1);
+
+        // get a file descriptor that is readable when there has been a write since it was last read
+        // can be used with poll/select/epoll along with sockets, timerfds, etc.
+        // it's an eventfd, read 8 bytes from it to clear it before reading shared memory
+        // a thread is started to watch shared memory, it's stopped on detach
+        // returns -1 on failure
+        int get_fd();
+
+        // only reads if there has been a write since the last read, otherwise returns failure
+        RetType read_if_updated(void* dst, size_t size, size_t offset = 0);
+
+        // reads from shared mem, blocks until there's a write
+        // blocking is not a spin lock, thread will no longer be scheduled
+        RetType read_block(void* dst, size_t size, size_t offset = 0);
+
+        // read packets written since the last packet read from the history ring, oldest first
+        // dst must fit 'max' packets (max * get_size() bytes) and records must fit 'max' records
+        // count is set to the number of packets read, missed is set to the number of packets
+        // overwritten before they could be read
+        // returns failure if there are no new packets or there is no history ring
+        RetType read_history(void* dst, packet_record_t* records, size_t max, size_t* count, size_t* missed);
+
+        // same as read_history, but blocks until there's at least one new packet
+        RetType read_history_block(void* dst, packet_record_t* records, size_t max, size_t* count, size_t* missed);
+
+        // copy only the measurements written since the last delta read into their place in 'dst'
+        // dst must fit a whole packet, anything not copied is left alone
+        // changed is set to the handle of every measurement copied
+        // returns failure if no measurements were written
+        RetType read_delta(void* dst, size_t size, std::vector<vcm::handle_t>& changed);
+
+        // same as read_delta, but blocks until at least one measurement is written
+        RetType read_delta_block(void* dst, size_t size, std::vector<vcm::handle_t>& changed);
+
+        // open a view of the packet in shared memory instead of copying it
+        // every view opened must be closed with end_view
+        // in LOCK_MODE the view holds the reader lock until it's closed, so keep it short, writers
+        // give up after WRITE_TIMEOUT and decom drops every packet received while a view is open longer
+        RetType begin_view(View* view);
+
+        // only opens a view if there has been a write since the last read, otherwise returns failure
+        RetType begin_view_if_updated(View* view);
+
+        // blocks until there's a write, then opens a view
+        RetType begin_view_block(View* view);
+
+        // close a view
+        // returns failure if the packet was written while the view was open, anything read
+        // from the view should be thrown away and the view opened again
+        // e.g.
+        //    do {
+        //        reader.begin_view_block(&view);
+        //        view.get(lat_info, &lat);
+        //        view.get(long_info, &lon);
+        //    } while(FAILURE == reader.end_view(&view));
+        RetType end_view(View* view);
+    private:
+        friend RetType wait_any(std::vector<Reader*>& readers, size_t* index);
+
+        uint32_t seq_read(void* dst, size_t size, size_t offset);
+        bool changed_since(uint32_t since, uint32_t* nonce);
+        bool sleep(uint32_t nonce, struct timespec* deadline);
+        void copy_changed(unsigned char* dst, std::vector<vcm::handle_t>& changed, uint64_t* write_seq);
+        RetType open_view(View* view);
+        RetType lock();
+        RetType unlock();
+
+        RetType rebind_paused();
+
+        void notify(uint32_t nonce);
+        void pause_notifier();
+        void resume_notifier();
+        void stop_notifier();
+
+        uint32_t last_nonce; // this will wrap around, but that's fine
+        uint64_t last_history_seq;
+        uint64_t last_write_seq; // write_seq as of the last delta read
+        uint32_t wake_mask; // wake groups subscribed to, read by the notifier thread too
+        std::vector<std::string> subscribed; // names subscribed to, to subscribe again after rebinding
+
+        int notify_fd;
+        bool notifying;
+        std::thread notifier;
+    };
+
+    // create shared memory
+    // readers and writers that attach use whatever mode it was created with
+    // every write also records the whole packet in a ring of 'history_slots' packets
+    // options are SHM_OPT_* options
+    // 'reserve' extra bytes are set aside for the packet so a larger layout can be published later
+    RetType create_shm(vcm::VCM* vcm, shm_mode_t mode = LOCK_MODE, size_t history_slots = 0, int options = 0,
+                       size_t reserve = 0);
+
+    // the functions below use a single Reader and Writer for the whole process
+
     // get the size of the block
     size_t get_shmem_size();
 
+    // get the number of packets kept in the history ring (0 if there is no history)
+    size_t get_history_slots();
+
     // attach the current process to the shared memory block
-    RetType attach_to_shm(vcm::VCM* vcm);
+    RetType attach_to_shm(vcm::VCM* vcm, int options = 0);
 
     // detach the current process to the shared memory block
     RetType detach_from_shm();
@@ -34,6 +478,9 @@ namespace shm {
     // returns failure if not all bytes were able to be written
     RetType write_to_shm(void* src, size_t size, size_t offset = 0);
 
+    // write the measurements from a received packet, laid out the same as shared memory
+    RetType write_packet_to_shm(const unsigned char* packet, vcm::packet_type_t* type, bool derived = false);
+
     // read from shared memory, size is max size to read
     // doesn't care how recent the read was
     // returns failure if not all bytes were able to be read
@@ -46,9 +493,28 @@ namespace shm {
     // blocking is not a spin lock, process will no longer be scheduled
     RetType read_from_shm_block(void* dst, size_t size, size_t offset = 0);
 
-    // create shared memory
-    RetType create_shm(vcm::VCM* vcm);
+    // read packets written since the last packet read from the history ring, oldest first
+    // see Reader::read_history
+    RetType read_history(void* dst, packet_record_t* records, size_t max, size_t* count, size_t* missed);
+
+    // same as read_history, but blocks until there's at least one new packet
+    RetType read_history_block(void* dst, packet_record_t* records, size_t max, size_t* count, size_t* missed);
 
     // set all shared memory to zero
     RetType clear_shm();
+
+    // release locks held by a process that died while holding them
+    // see Segment::recover
+    RetType recover_shm(bool* recovered);
+
+    // true if a new layout was published since the process last bound to one
+    bool layout_changed();
+
+    // get the generation of the layout published in shared memory
+    uint32_t get_generation();
+
+    // switch the process to the layout published in shared memory, see Segment::rebind
+    RetType rebind_shm();
 }
+
+#endif
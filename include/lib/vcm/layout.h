@@ -0,0 +1,89 @@
+/********************************************************************
+*  Name: layout.h
+*
+*  Purpose: Compile time packet layouts, used by headers generated
+*           from VCM config files with vcmgen.
+*
+*  RIT Launch Initiative
+*********************************************************************/
+#ifndef VCM_LAYOUT_H
+#define VCM_LAYOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "lib/vcm/vcm.h"
+#include "common/types.h"
+
+// a generated layout header describes one config file as types, so reading a measurement
+// compiles down to a load (and a byte swap if the receiver's endianness isn't ours)
+// instead of looking up the measurement and converting it byte by byte at runtime
+//
+// generate one with: vcmgen -f path_to_config_file -o path_to_header
+// the config file can change after the header is generated, so always call the generated
+// check() with the VCM actually in use before trusting the header
+namespace vcm {
+namespace layout {
+
+    // endianness of the system this is compiled for
+    constexpr endianness_t host_endianness = (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__) ? GSW_BIG_ENDIAN : GSW_LITTLE_ENDIAN;
+
+    // unsigned integer the same size as a measurement, used to hold its raw bytes
+    template<size_t SIZE> struct raw;
+    template<> struct raw<1> { typedef uint8_t type; };
+    template<> struct raw<2> { typedef uint16_t type; };
+    template<> struct raw<4> { typedef uint32_t type; };
+    template<> struct raw<8> { typedef uint64_t type; };
+
+    inline uint8_t swap(uint8_t val) { return val; }
+    inline uint16_t swap(uint16_t val) { return __builtin_bswap16(val); }
+    inline uint32_t swap(uint32_t val) { return __builtin_bswap32(val); }
+    inline uint64_t swap(uint64_t val) { return __builtin_bswap64(val); }
+
+    // a measurement that fits exactly in 'T' at byte 'OFFSET' of a packet sent in 'ENDIANNESS'
+    template<typename T, size_t OFFSET, endianness_t ENDIANNESS>
+    struct field {
+        typedef T type;
+        static constexpr size_t offset = OFFSET;
+        static constexpr size_t size = sizeof(T);
+
+        // 'packet' is a whole packet, not the measurement
+        static inline T get(const void* packet) {
+            typename raw<sizeof(T)>::type bits;
+            memcpy(&bits, (const unsigned char*)packet + OFFSET, sizeof(T));
+
+            // known at compile time, so there's no branch left after optimizing
+            if(ENDIANNESS != host_endianness) {
+                bits = swap(bits);
+            }
+
+            T val;
+            memcpy(&val, &bits, sizeof(T));
+            return val;
+        }
+    };
+
+    // a measurement with no type that fits it (strings, odd sizes, padded measurements)
+    template<size_t OFFSET, size_t SIZE>
+    struct bytes {
+        static constexpr size_t offset = OFFSET;
+        static constexpr size_t size = SIZE;
+
+        // pointer to the first byte of the measurement in 'packet'
+        static inline const unsigned char* get(const void* packet) {
+            return (const unsigned char*)packet + OFFSET;
+        }
+    };
+
+    // SUCCESS if 'vcm' lays out packets exactly the way a header with 'hash' expects
+    inline RetType check(VCM* vcm, uint64_t hash) {
+        if(vcm->layout_hash() != hash) {
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
+
+}
+}
+
+#endif
@@ -19,6 +19,11 @@
 
 #define DEFAULT_CONFIG_FILE "data/config"
 
+// the first time a config file is parsed its compiled layout is cached next to it, with this
+// appended to the name, as long as the config file doesn't change every VCM after that maps the
+// cache instead of parsing
+#define CACHE_FILE_EXTENSION ".bin"
+
 // responsible for translating config file into addresses in shared mem
 // address 0x00 is the first byte in shared mem
 // currently gives addr and size of data in shared mem (after attaching itself in constructor)
@@ -44,26 +49,123 @@ namespace vcm {
         UDP, PROTOCOL_NOT_SET
     } protocol_t;
 
+    // index of a measurement in VCM::measurements, stays the same as long as the config file does
+    // looking up a measurement by handle is just an array index, so look names up once and keep
+    // the handle around
+    typedef uint32_t handle_t;
+    const handle_t INVALID_HANDLE = 0xFFFFFFFF;
+
     typedef struct {
         void* addr; // offset into shmem
         size_t size; // bytes
         size_t l_padding; // bits of left padding (most significant bits)
         size_t r_padding; // bits of right padding (least significant bits)
+        // padding is counted after the bytes are put together in the receiver's endianness
+        // measurements sized in bits in the config file share bytes, the bits of their neighbors are their padding
         measurement_type_t type;
         measurement_sign_t sign;
     } measurement_info_t;
 
+    // a vehicle can send several types of packets, e.g. fast IMU packets and slow GPS packets
+    // every packet starts with the same header, which has a measurement saying the packet's type,
+    // and the rest of the packet is that type's measurements
+    // in shared memory the header comes first and then every type's measurements one after another,
+    // so each type only overwrites its own measurements
+    typedef struct {
+        uint32_t id; // value of the id measurement for this type
+        uint32_t reserved;
+        uint64_t addr; // offset of this type's measurements in shared memory
+        uint64_t size; // bytes of measurements after the header, a packet of this type is header_size + size bytes
+    } packet_type_t;
+
+    // derived measurements are computed from other measurements with an expression in the config file
+    // every expression is compiled into a few instructions for a small stack machine, the instructions
+    // for every derived measurement run one after another (see convert::derive)
+    typedef enum {
+        DERIVE_CONST, // push 'val'
+        DERIVE_INT, // push measurement 'handle', a signed integer
+        DERIVE_UINT, // push measurement 'handle', an unsigned integer
+        DERIVE_FLOAT, // push measurement 'handle', a 4 byte float
+        DERIVE_DOUBLE, // push measurement 'handle', an 8 byte float
+        DERIVE_ADD, DERIVE_SUB, DERIVE_MUL, DERIVE_DIV, // pop two, push the result
+        DERIVE_NEG, // pop one, push the result
+        DERIVE_STORE // pop one into derived measurement 'handle'
+    } derive_opcode_t;
+
+    typedef struct {
+        uint32_t op; // derive_opcode_t
+        handle_t handle;
+        double val;
+    } derive_op_t;
+
+    // most values an expression can need at once
+    #define MAX_DERIVE_STACK 16
+
+    // widest measurement that can be swapped to the system's endianness (see VCM::shm_endianness)
+    #define MAX_SWAP_SIZE 16
+
     class VCM {
     public:
         VCM(); // uses default config file
         VCM(std::string config_file);
         ~VCM();
 
+        // owns the mapped layout and the open config file, so it can't be copied
+        VCM(const VCM&) = delete;
+        VCM& operator=(const VCM&) = delete;
+
+        // parse the config file again, e.g. after it was edited
+        // every measurement_info_t pointer and handle from before is invalid afterwards, even on failure
+        RetType reload();
+
+        // write the compiled layout to 'cache_file'
+        // done automatically next to the config file when a config file has to be parsed
+        RetType write_cache(std::string cache_file);
+
         // returns NULL if no measurement with that name exists
-        measurement_info_t* get_info(std::string measurement); // get the info of a measurement
-        std::vector<std::string> measurements; // list of measurement names
+        measurement_info_t* get_info(const std::string& measurement); // get the info of a measurement
 
-        size_t packet_size; // bytes, size of packet after padding is added
+        // get the info of a measurement from its handle, handle must be valid
+        measurement_info_t* get_info(handle_t handle) {
+            return &(table[handle]);
+        }
+
+        // returns INVALID_HANDLE if no measurement with that name exists
+        handle_t get_handle(const std::string& measurement);
+
+        // get the type of a received packet from its id measurement
+        // returns NULL if the type is unknown or the packet is the wrong size for its type
+        packet_type_t* get_packet_type(const void* packet, size_t size);
+
+        // every packet type, num_packet_types of them
+        packet_type_t* get_packet_types() {
+            return packet_types;
+        }
+
+        // copy a received packet into 'dst', a packet_size buffer laid out the same as shared memory
+        // 'type' is set to the packet's type, or NULL if the vehicle doesn't have packet types
+        // returns failure if the packet is the wrong size or an unknown type
+        RetType unpack(unsigned char* dst, const void* packet, size_t size, packet_type_t** type = NULL);
+
+        // hash of everything that decides where and how measurements sit in a packet
+        // two VCMs with the same layout hash decode packets the same way
+        uint64_t layout_hash();
+
+        std::vector<std::string> measurements; // list of measurement names, in handle order
+
+        size_t packet_size; // bytes, size of packet after padding is added (in shared memory, with every packet type)
+        size_t recv_size; // bytes, size of a received packet if there aren't packet types
+
+        // derived measurements are 8 byte floats in the receiver's endianness, after the received measurements
+        size_t num_derived;
+        size_t derived_addr; // offset of the first derived measurement
+        derive_op_t* derive_ops; // instructions that compute every derived measurement
+        size_t num_derive_ops;
+
+        // only used if the config file has packet types
+        size_t num_packet_types; // 0 if every packet is the same
+        size_t header_size; // bytes at the start of every packet, before the type's measurements
+        handle_t id_handle; // measurement in the header with the packet type
         // size_t compressed_size; // bits, size of packet before padding added
 
         // TODO maybe put addr and port in another subclass
@@ -75,13 +177,36 @@ namespace vcm {
 
         endianness_t recv_endianness; // endianness of the receiver
         endianness_t sys_endianness; // endianness of the system GSW is running on
+
+        // endianness of measurements in shared memory
+        // decom swaps received measurements to the system's endianness when every measurement can be
+        // swapped on its own (see convert::Swapper), otherwise they stay in the receiver's endianness
+        // always read shared memory with this, not recv_endianness
+        endianness_t shm_endianness;
     private:
         // local vars
         std::ifstream* f;
-        std::unordered_map<std::string, measurement_info_t*> addr_map;
+
+        // compiled layout, either mapped from the cache file or built after parsing the config file
+        unsigned char* image;
+        size_t image_size;
+        bool mapped;
+
+        // tables in the image
+        measurement_info_t* table; // every measurement, indexed by handle
+        uint64_t* names; // offset of each measurement's name in the image, indexed by handle
+        uint32_t* hash_seeds; // perfect hash seed for each bucket
+        uint32_t* hash_handles; // handle of the measurement in each hash slot, or INVALID_HANDLE
+        packet_type_t* packet_types;
+        uint32_t num_hash_buckets;
+        uint32_t num_hash_slots;
 
         // helper method(s)
+        void set_defaults();
         RetType init();
+        RetType parse();
+        RetType load_cache(std::string cache_file);
+        RetType load_image();
     };
 }
 
@@ -2,205 +2,592 @@
 #include "lib/dls/dls.h"
 #include <stdint.h>
 #include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <utility>
+
+// std::to_chars for floats needs C++17 and GCC 11 or newer, older compilers fall back to snprintf
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define HAVE_TO_CHARS
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SSSE3_SWAP
+#endif
 
 using namespace vcm;
 using namespace dls;
 
-char result[MAX_CONVERSION_SIZE];
-
 // TODO maybe have a fancy function with va_args, idk
 
 
-RetType convert::convert_float(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, float* dst) {
-    MsgLogger logger("CONVERT", "convert_float");
-
-    if(measurement->type != FLOAT_TYPE) {
-        logger.log_message("Measurement must be a float type!");
-        return FAILURE;
+// bit width of the value in a measurement, 0 if it's all padding
+static inline size_t value_bits(measurement_info_t* measurement) {
+    size_t bits = measurement->size * 8;
+    if(measurement->l_padding + measurement->r_padding >= bits) {
+        return 0;
     }
+    return bits - measurement->l_padding - measurement->r_padding;
+}
+
+// 8 bytes starting at 'buff' as an integer with the first byte least significant
+static inline uint64_t load_le64(const unsigned char* buff) {
+    uint64_t word;
+    memcpy(&word, buff, sizeof(uint64_t));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// 8 bytes starting at 'buff' as an integer with the first byte most significant
+static inline uint64_t load_be64(const unsigned char* buff) {
+    uint64_t word;
+    memcpy(&word, buff, sizeof(uint64_t));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+RetType convert::extract(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, uint64_t* dst) {
+    size_t size = measurement->size;
+    size_t bits = value_bits(measurement);
 
-    if(measurement->size != sizeof(float)) {
-        logger.log_message("measurement is not the size of a float!");
+    if(size > sizeof(uint64_t) || bits == 0) {
+        MsgLogger logger("CONVERT", "extract");
+        logger.log_message("Measurement must be 1 to 8 bytes and not all padding");
         return FAILURE;
     }
 
-    uint8_t val[sizeof(float)];
     size_t addr = (size_t)measurement->addr;
-    const uint8_t* buff = (const uint8_t*)data;
+    const unsigned char* buff = (const unsigned char*)data + addr;
+
+    // load a whole word at once, the bytes past the measurement get shifted and masked off
+    // only the last few measurements in a packet need to be copied into a word first
+    unsigned char tail[sizeof(uint64_t)];
+    if(addr + sizeof(uint64_t) > vcm->packet_size) {
+        memset(tail, 0, sizeof(uint64_t));
+        memcpy(tail, buff, size);
+        buff = tail;
+    }
 
-    if(vcm->recv_endianness != vcm->sys_endianness) {
-        for(size_t i = 0; i < measurement->size; i++) {
-            val[sizeof(uint32_t) - i - 1] = buff[addr + i];
-        }
+    uint64_t word;
+    if(vcm->shm_endianness == GSW_BIG_ENDIAN) {
+        // the measurement is the top 'size' bytes of the word
+        word = load_be64(buff) >> (64 - (size * 8) + measurement->r_padding);
     } else {
-        for(size_t i = 0; i < measurement->size; i++) {
-            val[i] = buff[addr + i];
+        // the measurement is the bottom 'size' bytes of the word
+        word = load_le64(buff) >> measurement->r_padding;
+    }
+
+    if(bits < 64) {
+        word &= ((uint64_t)1 << bits) - 1;
+
+        // sign extend from the top bit of the value
+        if(measurement->type == INT_TYPE && measurement->sign == SIGNED_TYPE) {
+            size_t shift = 64 - bits;
+            word = (uint64_t)((int64_t)(word << shift) >> shift);
         }
     }
 
-    *dst = *((float*)val);
+    *dst = word;
+    return SUCCESS;
+}
+
+RetType convert::convert_float(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, float* dst) {
+    if(FAILURE == convert<float>(vcm, measurement, data, dst)) {
+        MsgLogger logger("CONVERT", "convert_float");
+        logger.log_message("Measurement must be a float or an integer of at most 24 bits!");
+        return FAILURE;
+    }
     return SUCCESS;
 }
 
 RetType convert::convert_uint(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, uint32_t* dst) {
-    MsgLogger logger("CONVERT", "convert_uint");
+    if(FAILURE == convert<uint32_t>(vcm, measurement, data, dst)) {
+        MsgLogger logger("CONVERT", "convert_uint");
+        logger.log_message("Measurement must be an unsigned integer of at most 32 bits!");
+        return FAILURE;
+    }
+    return SUCCESS;
+}
 
-    if(measurement->type != INT_TYPE || measurement->sign != UNSIGNED_TYPE) {
-        logger.log_message("Measurement must be an unsigned integer!");
+RetType convert::convert_int(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, int32_t* dst) {
+    if(FAILURE == convert<int32_t>(vcm, measurement, data, dst)) {
+        MsgLogger logger("CONVERT", "convert_int");
+        logger.log_message("Measurement must be a signed integer of at most 32 bits or an unsigned integer of at most 31 bits!");
         return FAILURE;
     }
+    return SUCCESS;
+}
 
-    if(measurement->size > sizeof(int32_t)) {
-        logger.log_message("measurement too large to fit into integer");
+
+RetType convert::convert_str(VCM* vcm, measurement_info_t* measurement, const void* data, std::string* dst) {
+    value_t value;
+    if(FAILURE == decode(vcm, measurement, data, &value)) {
+        MsgLogger logger("CONVERT", "convert_str");
+        logger.log_message("Measurement can't be converted to a string");
         return FAILURE;
     }
 
-    uint8_t val[sizeof(uint32_t)];
-    size_t addr = (size_t)measurement->addr;
-    const uint8_t* buff = (const uint8_t*)data;
+    dst->clear();
+    return append(*dst, &value);
+}
 
-    if(vcm->recv_endianness != vcm->sys_endianness) {
-        for(size_t i = 0; i < measurement->size; i++) {
-            val[sizeof(uint32_t) - i - 1] = buff[addr + i];
-        }
+// what 'measurement' decodes to, the same checks as the convert_* functions
+static convert::value_kind_t value_kind(measurement_info_t* measurement) {
+    size_t bits = value_bits(measurement);
+
+    if(measurement->type == STRING_TYPE) {
+        return convert::STRING_VALUE;
+    } else if(bits == 0 || measurement->size > sizeof(uint64_t)) {
+        return convert::NO_VALUE;
+    } else if(measurement->type == INT_TYPE) {
+        return (measurement->sign == SIGNED_TYPE) ? convert::INT_VALUE : convert::UINT_VALUE;
+    } else if(measurement->type == FLOAT_TYPE && bits == sizeof(float) * 8) {
+        return convert::FLOAT_VALUE;
+    } else if(measurement->type == FLOAT_TYPE && bits == sizeof(double) * 8) {
+        return convert::DOUBLE_VALUE;
+    }
+
+    return convert::NO_VALUE;
+}
+
+void convert::plan(VCM* vcm, measurement_info_t* measurement, field_t* field) {
+    size_t bits = value_bits(measurement);
+    bool big = (vcm->shm_endianness == GSW_BIG_ENDIAN);
+
+    memset(field, 0, sizeof(field_t));
+    field->addr = (size_t)measurement->addr;
+    field->size = measurement->size;
+    field->kind = value_kind(measurement); // only checked once
+    field->bits = bits;
+    field->swap = (vcm->shm_endianness != vcm->sys_endianness);
+    field->tail = (field->addr + sizeof(uint64_t) > vcm->packet_size);
+
+    if(field->kind == STRING_VALUE || field->kind == NO_VALUE) {
+        return;
+    } else if(field->kind == INT_VALUE && bits < 64) {
+        field->extend = 64 - bits;
+    }
+
+    // same as extract, once a word is in the system's endianness a big endian measurement is the
+    // top 'size' bytes of it
+    field->shift = measurement->r_padding + (big ? 64 - (measurement->size * 8) : 0);
+    field->mask = (bits < 64) ? ((uint64_t)1 << bits) - 1 : ~((uint64_t)0);
+}
+
+RetType convert::decode(VCM* vcm, measurement_info_t* measurement, const void* data, value_t* dst) {
+    dst->kind = value_kind(measurement);
+
+    if(dst->kind == STRING_VALUE) {
+        dst->str = (const char*)data + (size_t)measurement->addr;
+        dst->len = strnlen(dst->str, measurement->size);
+        return SUCCESS;
+    } else if(dst->kind == NO_VALUE) {
+        return FAILURE;
+    }
+
+    uint64_t raw;
+    if(FAILURE == extract(vcm, measurement, data, &raw)) {
+        return FAILURE;
+    }
+
+    if(dst->kind == FLOAT_VALUE) {
+        uint32_t val32 = (uint32_t)raw;
+        memcpy(&(dst->f), &val32, sizeof(float));
+    } else if(dst->kind == DOUBLE_VALUE) {
+        memcpy(&(dst->d), &raw, sizeof(double));
     } else {
-        for(size_t i = 0; i < measurement->size; i++) {
-            val[i] = buff[addr + i];
-        }
+        dst->u = raw;
     }
 
-    *dst = *((uint32_t*)val);
     return SUCCESS;
 }
 
-RetType convert::convert_int(vcm::VCM* vcm, vcm::measurement_info_t* measurement, const void* data, int32_t* dst) {
-    MsgLogger logger("CONVERT", "convert_int");
+char* convert::format(char* dst, char* end, const value_t* value) {
+    if(value->kind == STRING_VALUE) {
+        if((size_t)(end - dst) < value->len) {
+            return NULL;
+        }
+        memcpy(dst, value->str, value->len);
+        return dst + value->len;
+    }
+
+#ifdef HAVE_TO_CHARS
+    std::to_chars_result res;
+
+    // floats are written as the shortest text that reads back as the same value
+    switch(value->kind) {
+        case INT_VALUE:
+            res = std::to_chars(dst, end, value->i);
+            break;
+        case UINT_VALUE:
+            res = std::to_chars(dst, end, value->u);
+            break;
+        case FLOAT_VALUE:
+            res = std::to_chars(dst, end, value->f);
+            break;
+        case DOUBLE_VALUE:
+            res = std::to_chars(dst, end, value->d);
+            break;
+        default:
+            return NULL;
+    }
 
-    if(measurement->type != INT_TYPE || measurement->sign != UNSIGNED_TYPE) {
-        logger.log_message("Measurement must be an unsigned integer!");
+    if(res.ec != std::errc()) {
+        return NULL;
+    }
+    return res.ptr;
+#else
+    // enough digits to read back as the same value, but not always the shortest
+    // snprintf adds a null terminator, so format into a buffer first
+    char text[MAX_NUMBER_TEXT + 1];
+    int len;
+
+    switch(value->kind) {
+        case INT_VALUE:
+            len = snprintf(text, sizeof(text), "%lld", (long long)value->i);
+            break;
+        case UINT_VALUE:
+            len = snprintf(text, sizeof(text), "%llu", (unsigned long long)value->u);
+            break;
+        case FLOAT_VALUE:
+            len = snprintf(text, sizeof(text), "%.9g", value->f);
+            break;
+        case DOUBLE_VALUE:
+            len = snprintf(text, sizeof(text), "%.17g", value->d);
+            break;
+        default:
+            return NULL;
+    }
+
+    if(len < 0 || (size_t)len >= sizeof(text) || (size_t)(end - dst) < (size_t)len) {
+        return NULL;
+    }
+    memcpy(dst, text, len);
+    return dst + len;
+#endif
+}
+
+RetType convert::append(std::string& dst, const value_t* value) {
+    if(value->kind == STRING_VALUE) {
+        dst.append(value->str, value->len);
+        return SUCCESS;
+    }
+
+    char buff[MAX_NUMBER_TEXT];
+    char* end = format(buff, buff + MAX_NUMBER_TEXT, value);
+    if(!end) {
         return FAILURE;
     }
 
-    if(measurement->size > sizeof(int32_t)) {
-        logger.log_message("measurement too large to fit into integer");
+    dst.append(buff, end - buff);
+    return SUCCESS;
+}
+
+RetType convert::derive(VCM* vcm, unsigned char* packet) {
+    double stack[MAX_DERIVE_STACK];
+    size_t top = 0;
+
+    // the compiler already checked every measurement and the stack depth
+    for(size_t i = 0; i < vcm->num_derive_ops; i++) {
+        derive_op_t* op = &(vcm->derive_ops[i]);
+        uint64_t raw = 0;
+
+        switch(op->op) {
+            case DERIVE_CONST:
+                stack[top++] = op->val;
+                break;
+            case DERIVE_INT:
+            case DERIVE_UINT:
+            case DERIVE_FLOAT:
+            case DERIVE_DOUBLE:
+                if(FAILURE == extract(vcm, vcm->get_info(op->handle), packet, &raw)) {
+                    return FAILURE;
+                }
+
+                if(op->op == DERIVE_INT) {
+                    stack[top++] = (double)(int64_t)raw;
+                } else if(op->op == DERIVE_UINT) {
+                    stack[top++] = (double)raw;
+                } else if(op->op == DERIVE_FLOAT) {
+                    uint32_t val32 = (uint32_t)raw;
+                    float val;
+                    memcpy(&val, &val32, sizeof(float));
+                    stack[top++] = val;
+                } else {
+                    double val;
+                    memcpy(&val, &raw, sizeof(double));
+                    stack[top++] = val;
+                }
+                break;
+            case DERIVE_ADD:
+                top--;
+                stack[top - 1] += stack[top];
+                break;
+            case DERIVE_SUB:
+                top--;
+                stack[top - 1] -= stack[top];
+                break;
+            case DERIVE_MUL:
+                top--;
+                stack[top - 1] *= stack[top];
+                break;
+            case DERIVE_DIV:
+                top--;
+                stack[top - 1] /= stack[top];
+                break;
+            case DERIVE_NEG:
+                stack[top - 1] = -stack[top - 1];
+                break;
+            case DERIVE_STORE: {
+                // stored like every other measurement in shared memory, so it reads back the same way
+                memcpy(&raw, &(stack[--top]), sizeof(double));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                if(vcm->shm_endianness == GSW_BIG_ENDIAN) {
+                    raw = __builtin_bswap64(raw);
+                }
+#else
+                if(vcm->shm_endianness == GSW_LITTLE_ENDIAN) {
+                    raw = __builtin_bswap64(raw);
+                }
+#endif
+                memcpy(packet + (size_t)vcm->get_info(op->handle)->addr, &raw, sizeof(double));
+                }
+                break;
+        }
+    }
+
+    return SUCCESS;
+}
+
+convert::Decoder::Decoder(): swap(false) {
+    // nothing else to do
+}
+
+RetType convert::Decoder::init(VCM* vcm) {
+    if(!vcm) {
+        MsgLogger logger("CONVERT", "Decoder::init");
+        logger.log_message("No VCM to build decoder for");
         return FAILURE;
     }
 
-    uint8_t val[sizeof(int32_t)];
-    size_t addr = (size_t)measurement->addr;
-    const uint8_t* buff = (const uint8_t*)data;
+    swap = (vcm->shm_endianness != vcm->sys_endianness);
+
+    fields.clear();
+    fields.resize(vcm->measurements.size());
+
+    for(handle_t handle = 0; handle < fields.size(); handle++) {
+        plan(vcm, vcm->get_info(handle), &(fields[handle]));
+    }
+
+    return SUCCESS;
+}
+
+template <bool SWAP>
+inline void convert::Decoder::decode_field(const unsigned char* packet, const field_t* field, value_t* value) {
+    value->kind = field->kind;
+
+    if(field->kind == STRING_VALUE) {
+        const char* buff = (const char*)packet + field->addr;
+        value->str = buff;
+        value->len = strnlen(buff, field->size);
+        return;
+    } else if(field->kind == NO_VALUE) {
+        return;
+    }
+
+    uint64_t word = load(field, packet, SWAP);
 
-    if(vcm->recv_endianness != vcm->sys_endianness) {
-        for(size_t i = 0; i < measurement->size; i++) {
-            val[sizeof(int32_t) - i - 1] = buff[addr + i];
+    if(field->kind == FLOAT_VALUE) {
+        uint32_t val32 = (uint32_t)word;
+        memcpy(&(value->f), &val32, sizeof(float));
+    } else if(field->kind == DOUBLE_VALUE) {
+        memcpy(&(value->d), &word, sizeof(double));
+    } else {
+        value->u = word; // same bits for every other kind
+    }
+}
+
+void convert::Decoder::decode(const void* packet, value_t* frame) {
+    const unsigned char* buff = (const unsigned char*)packet;
+    size_t n = fields.size();
+
+    // the endianness check is hoisted out of the loop
+    if(swap) {
+        for(size_t i = 0; i < n; i++) {
+            decode_field<true>(buff, &(fields[i]), &(frame[i]));
         }
     } else {
-        for(size_t i = 0; i < measurement->size; i++) {
-            val[i] = buff[addr + i];
+        for(size_t i = 0; i < n; i++) {
+            decode_field<false>(buff, &(fields[i]), &(frame[i]));
         }
     }
-
-    *dst = *((int32_t*)val);
-    return SUCCESS;
 }
 
+void convert::Decoder::decode(const void* packet, value_t* frame, const std::vector<handle_t>& handles) {
+    const unsigned char* buff = (const unsigned char*)packet;
 
-// NOTE: may be a problem if unsigned and signed ints aren't the same length
-//       but that would be weird to have them not the same length
-// TODO this function could use some cleaning, uses malloc when it doesnt need to, some unnecessary code from it being refactored so many times
-RetType convert::convert_str(VCM* vcm, measurement_info_t* measurement, const void* data, std::string* dst) {
-    MsgLogger logger("CONVERT", "convert_str");
-
-    switch(measurement->type) {
-        // all integer types, will try to put it a standard integer type of the same size or larger than the measurement size
-        // distinguishes between signed and unsigned
-        case INT_TYPE: {
-            if(measurement->size > (sizeof(long int))) {
-                logger.log_message("Measurement size too great to convert to integer");
-                return FAILURE; // TODO add logging
-            }
+    if(swap) {
+        for(handle_t handle : handles) {
+            decode_field<true>(buff, &(fields[handle]), &(frame[handle]));
+        }
+    } else {
+        for(handle_t handle : handles) {
+            decode_field<false>(buff, &(fields[handle]), &(frame[handle]));
+        }
+    }
+}
 
-            // assume unsigned and signed are the same size (potential problem)
-            unsigned char val[sizeof(long int)]; // always assume it's the biggest (don't care about a few bytes)
-            memset(val, 0, sizeof(long int));
+#ifdef HAVE_SSSE3_SWAP
+// swap one chunk with a single shuffle, bytes past the chunk shuffle to themselves
+__attribute__((target("ssse3")))
+static void shuffle16(unsigned char* buff, const unsigned char* shuffle) {
+    __m128i data = _mm_loadu_si128((const __m128i*)buff);
+    __m128i mask = _mm_loadu_si128((const __m128i*)shuffle);
+    _mm_storeu_si128((__m128i*)buff, _mm_shuffle_epi8(data, mask));
+}
+#endif
 
-            size_t addr = (size_t)measurement->addr;
-            const unsigned char* buff = (const unsigned char*)data;
+convert::Swapper::Swapper(): packet_size(0), header_size(0), recv_size(0), simd(false) {
+    // nothing else to do
+}
 
-            if(vcm->recv_endianness != vcm->sys_endianness) {
-                for(size_t i = 0; i < measurement->size; i++) {
-                    val[sizeof(long int) - i - 1] = buff[addr + i];
-                }
-            } else {
-                for(size_t i = 0; i < measurement->size; i++) {
-                    val[i] = buff[addr + i];
-                }
-            }
+RetType convert::Swapper::init(VCM* vcm) {
+    if(!vcm) {
+        MsgLogger logger("CONVERT", "Swapper::init");
+        logger.log_message("No VCM to build swapper for");
+        return FAILURE;
+    }
 
-            if(measurement->sign == SIGNED_TYPE) { // signed
-                snprintf(result, MAX_CONVERSION_SIZE, "%li", *((int64_t*)val));
-            } else { // unsigned
-                snprintf(result, MAX_CONVERSION_SIZE, "%lu", *((uint64_t*)val));
-            }
+    packet_size = vcm->packet_size;
+    header_size = vcm->header_size;
+    recv_size = vcm->recv_size;
+    chunks.clear();
 
-            }
-            break;
+#ifdef HAVE_SSSE3_SWAP
+    simd = __builtin_cpu_supports("ssse3");
+#endif
 
-        // encompasses 4-byte floats and 8-byte doubles
-        case FLOAT_TYPE: {
-            size_t convert_size = 0;
-            if(measurement->size == sizeof(float)) {
-                convert_size = sizeof(float);
-            } else if(measurement->size == sizeof(double)) {
-                convert_size = sizeof(double);
-            }
+    if(vcm->shm_endianness == vcm->recv_endianness) {
+        return SUCCESS; // nothing to swap
+    }
 
-            if(convert_size == 0) {
-                logger.log_message("Unable to convert floating type to float or double");
-                return FAILURE;
-            }
+    // every received measurement that isn't a string, 1 byte ones too since they can share a byte
+    bool owned = true; // every measurement owns its own bytes
+    std::vector<std::pair<size_t, size_t>> spans;
+    for(handle_t handle = 0; handle < vcm->measurements.size(); handle++) {
+        measurement_info_t* info = vcm->get_info(handle);
+        size_t addr = (size_t)info->addr;
+        if(info->type != STRING_TYPE && addr < recv_size) {
+            spans.push_back(std::make_pair(addr, info->size));
+        }
 
-            unsigned char* val = (unsigned char*)malloc(convert_size);
-            memset(val, 0, convert_size);
+        if(info->l_padding || info->r_padding) {
+            owned = false;
+        }
+    }
+    std::sort(spans.begin(), spans.end());
 
-            size_t addr = (size_t)measurement->addr;
-            const unsigned char* buff = (const unsigned char*)data;
+    for(size_t i = 1; i < spans.size(); i++) {
+        if(spans[i].first < spans[i - 1].first + spans[i - 1].second) {
+            owned = false;
+        }
+    }
 
-            if(vcm->recv_endianness != vcm->sys_endianness) {
-                for(size_t i = 0; i < measurement->size; i++) {
-                    val[convert_size - i - 1] = buff[addr + i];
-                }
-            } else {
-                for(size_t i = 0; i < measurement->size; i++) {
-                    val[i] = buff[addr + i];
-                }
-            }
+    // the VCM only keeps shared memory in the system's endianness if every measurement owns its own
+    // bytes, this is checked again so a chunk never moves bytes that belong to two measurements
+    if(!owned) {
+        MsgLogger logger("CONVERT", "Swapper::init");
+        logger.log_message("Measurements share bytes, packets can't be swapped");
+        return FAILURE;
+    }
 
-            // sign doesn't exist for floating point
-            snprintf(result, MAX_CONVERSION_SIZE, "%f", *((float*)val));
+    // packets of each type only write their own measurements, so a chunk can't cross into another type
+    std::vector<size_t> regions;
+    if(vcm->num_packet_types > 0) {
+        regions.push_back(header_size);
+        packet_type_t* types = vcm->get_packet_types();
+        for(size_t i = 0; i < vcm->num_packet_types; i++) {
+            regions.push_back(types[i].addr);
+        }
+        std::sort(regions.begin(), regions.end());
+    }
 
-            free(val);
-            }
-            break;
+    for(std::pair<size_t, size_t>& span : spans) {
+        size_t region = std::upper_bound(regions.begin(), regions.end(), span.first) - regions.begin();
 
-        case STRING_TYPE: {
-            // -1 is for room for a null terminator
-            if(measurement->size > MAX_CONVERSION_SIZE - 1) {
-                return FAILURE; // TODO add logging
+        // start a new chunk if this measurement doesn't fit in the last one
+        if(chunks.size() > 0) {
+            chunk_t& last = chunks.back();
+            size_t last_region = std::upper_bound(regions.begin(), regions.end(), (size_t)last.offset) - regions.begin();
+            if(region != last_region || span.first + span.second - last.offset > sizeof(last.shuffle)) {
+                chunks.push_back(chunk_t());
             }
-            size_t addr = (size_t)measurement->addr;
-            const unsigned char* buff = (const unsigned char*)data;
-            memcpy(result, buff + addr, measurement->size);
-            result[measurement->size] = '\0'; // null terminate just in case
+        } else {
+            chunks.push_back(chunk_t());
+        }
 
+        chunk_t& chunk = chunks.back();
+        if(chunk.size == 0) {
+            chunk.offset = span.first;
+            for(size_t i = 0; i < sizeof(chunk.shuffle); i++) {
+                chunk.shuffle[i] = i;
             }
-            break;
+        }
 
-        default:
-            // TODO maybe display as hex?
-            return FAILURE;
+        size_t start = span.first - chunk.offset;
+        for(size_t i = 0; i < span.second; i++) {
+            chunk.shuffle[start + i] = start + span.second - 1 - i;
+        }
+        chunk.size = start + span.second;
     }
 
-    *dst = result;
     return SUCCESS;
 }
+
+void convert::Swapper::swap(unsigned char* packet, size_t start, size_t end) {
+    auto it = std::lower_bound(chunks.begin(), chunks.end(), start, [](const chunk_t& chunk, size_t offset) {
+        return chunk.offset < offset;
+    });
+
+    for(; it != chunks.end() && it->offset < end; it++) {
+        unsigned char* buff = packet + it->offset;
+
+#ifdef HAVE_SSSE3_SWAP
+        // the shuffle always touches 16 bytes, the last chunks of a packet may not have that many
+        if(simd && it->offset + sizeof(it->shuffle) <= packet_size) {
+            shuffle16(buff, it->shuffle);
+            continue;
+        }
+#endif
+
+        unsigned char tmp[sizeof(it->shuffle)];
+        memcpy(tmp, buff, it->size);
+        for(size_t i = 0; i < it->size; i++) {
+            buff[i] = tmp[it->shuffle[i]];
+        }
+    }
+}
+
+void convert::Swapper::swap_packet(unsigned char* packet, packet_type_t* type) {
+    if(chunks.size() == 0) {
+        return;
+    }
+
+    if(type) {
+        swap(packet, 0, header_size);
+        swap(packet, type->addr, type->addr + type->size);
+    } else {
+        swap(packet, 0, recv_size);
+    }
+}
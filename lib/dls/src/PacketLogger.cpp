@@ -19,7 +19,7 @@ RetType PacketLogger::log_packet(unsigned char* buffer, size_t size) {
     header += "<" + device_name + ">";
     uint32_t len = strlen(header.c_str()) * sizeof(char); // want to get actual # of bytes
 
-    uint32_t out_size = len + size + sizeof(uint32_t);
+    uint32_t out_size = len + sizeof(size_t) + size; // room for the size as it's written below
 
     char* out_buff = new char[out_size];
 
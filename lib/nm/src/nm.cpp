@@ -7,6 +7,7 @@
 #include <exception>
 #include <unistd.h>
 #include "lib/nm/nm.h"
+#include "lib/nm/uring.h"
 #include "lib/dls/dls.h"
 #include "lib/shm/shm.h"
 #include "common/types.h"
@@ -16,10 +17,9 @@ using namespace dls;
 using namespace shm;
 using namespace vcm;
 
-#define MAX_MSG_SIZE 4096
 #define RECV_TIMEOUT 100000 // 100ms
 
-NetworkManager::NetworkManager(VCM* vcm) {
+NetworkManager::NetworkManager(VCM* vcm, backend_t backend) {
     mqueue_name = "/";
     mqueue_name += vcm->device;
 
@@ -29,9 +29,19 @@ NetworkManager::NetworkManager(VCM* vcm) {
 
     open = false;
 
-    in_buffer = new char[vcm->packet_size];
+    this->backend = backend;
+    ring = NULL;
+
+    // sized for the largest datagram recvfrom can write, not just the packet we expect
+    in_buffer = new char[MAX_MSG_SIZE];
     in_size = 0;
 
+    pool = new char[MAX_BATCH_SIZE * MAX_MSG_SIZE];
+    for(size_t i = 0; i < MAX_BATCH_SIZE; i++) {
+        batch_iovs[i].iov_base = pool + (i * MAX_MSG_SIZE);
+        batch_iovs[i].iov_len = MAX_MSG_SIZE;
+    }
+
     // if(SUCCESS != Open()) {
     //     throw new std::runtime_error("failed to open network manager");
     // }
@@ -46,9 +56,17 @@ NetworkManager::~NetworkManager() {
         delete[] in_buffer;
     }
 
+    if(pool) {
+        delete[] pool;
+    }
+
     if(open) {
         Close();
     }
+
+    if(ring) {
+        delete ring;
+    }
 }
 
 RetType NetworkManager::Open() {
@@ -134,6 +152,16 @@ RetType NetworkManager::Open() {
         return FAILURE;
     }
 
+    if(backend == URING_BACKEND) {
+        ring = new URing();
+        if(FAILURE == ring->Open(sockfd, MAX_MSG_SIZE)) {
+            logger.log_message("io_uring not supported, falling back to the socket");
+            delete ring;
+            ring = NULL;
+            backend = SOCKET_BACKEND;
+        }
+    }
+
     return SUCCESS;
 }
 
@@ -147,6 +175,10 @@ RetType NetworkManager::Close() {
         logger.log_message("nothing to close, network manager not open");
     }
 
+    if(ring) {
+        ring->Close();
+    }
+
     if(0 != mq_close(mq)) {
         ret = FAILURE;
         logger.log_message("unable to close mqueue");
@@ -161,9 +193,9 @@ RetType NetworkManager::Close() {
 }
 
 RetType NetworkManager::Send() {
-    MsgLogger logger("NetworkManager", "Send");
-
+    // called every time through decom's loop, so the logger (which opens an mqueue) is only made on errors
     if(!open) {
+        MsgLogger logger("NetworkManager", "Send");
         logger.log_message("network manager not open");
         return FAILURE;
     }
@@ -177,6 +209,7 @@ RetType NetworkManager::Send() {
     if(read != -1) {
         // device address has not been set (still zeroed)
         if(0 == device_addr.sin_port) {
+            MsgLogger logger("NetworkManager", "Send");
             logger.log_message("Receiver has not yet sent a packet providing a port \
                             and address, failed to send UDP message");
             return FAILURE;
@@ -186,6 +219,7 @@ RetType NetworkManager::Send() {
         sent = sendto(sockfd, buffer, read, 0,
             (struct sockaddr*)&device_addr, sizeof(device_addr)); // send to whatever we last received from
         if(sent == -1) {
+            MsgLogger logger("NetworkManager", "Send");
             logger.log_message("Failed to send UDP message");
             return FAILURE;
         }
@@ -195,7 +229,16 @@ RetType NetworkManager::Send() {
 }
 
 RetType NetworkManager::Receive() {
-    MsgLogger logger("NetworkManager", "Receive");
+    if(ring) {
+        char* data;
+        if(0 == ring->Receive(&data, &in_size, 1, &device_addr)) {
+            in_size = 0;
+            return FAILURE;
+        }
+
+        memcpy(in_buffer, data, in_size);
+        return SUCCESS;
+    }
 
     int n = -1;
     socklen_t len = sizeof(device_addr);
@@ -211,7 +254,7 @@ RetType NetworkManager::Receive() {
     }
 
     // set in size to the size of the buffer if we received too much data for our buffer
-    if(n > MAX_MSG_SIZE) {
+    if((size_t)n > MAX_MSG_SIZE) {
         in_size = MAX_MSG_SIZE;
     } else {
         in_size = n;
@@ -220,6 +263,60 @@ RetType NetworkManager::Receive() {
     return SUCCESS;
 }
 
+RetType NetworkManager::ReceiveBatch(batch_t* batch) {
+    batch->count = 0;
+
+    // the kernel already received them, so collecting them doesn't take a system call
+    if(ring) {
+        batch->count = ring->Receive(batch->data, batch->size, MAX_BATCH_SIZE, &device_addr);
+        return batch->count ? SUCCESS : FAILURE;
+    }
+
+    // recvmmsg overwrites the headers, so they're set up again every call
+    memset(batch_msgs, 0, sizeof(batch_msgs));
+    for(size_t i = 0; i < MAX_BATCH_SIZE; i++) {
+        batch_msgs[i].msg_hdr.msg_iov = &(batch_iovs[i]);
+        batch_msgs[i].msg_hdr.msg_iovlen = 1;
+        batch_msgs[i].msg_hdr.msg_name = &(batch_addrs[i]);
+        batch_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    // same flags as Receive, returns whatever is waiting instead of waiting for a full batch
+    int n = recvmmsg(sockfd, batch_msgs, MAX_BATCH_SIZE, MSG_DONTWAIT | MSG_TRUNC, NULL);
+
+    if(n <= 0) { // nothing waiting or error
+        return FAILURE;
+    }
+
+    for(int i = 0; i < n; i++) {
+        batch->data[i] = (char*)batch_iovs[i].iov_base;
+
+        // set the size to the size of the buffer if we received too much data for our buffer
+        if(batch_msgs[i].msg_len > MAX_MSG_SIZE) {
+            batch->size[i] = MAX_MSG_SIZE;
+        } else {
+            batch->size[i] = batch_msgs[i].msg_len;
+        }
+    }
+    batch->count = n;
+
+    // same as recvfrom, send to whatever we last received from
+    memcpy(&device_addr, &(batch_addrs[n - 1]), sizeof(device_addr));
+
+    return SUCCESS;
+}
+
+int NetworkManager::ReceiveFd() {
+    if(ring) {
+        return ring->Fd();
+    }
+    return sockfd;
+}
+
+int NetworkManager::QueueFd() {
+    return (int)mq;
+}
+
 NetworkInterface::NetworkInterface(VCM* vcm) {
     mqueue_name = "/";
     mqueue_name += vcm->device;
@@ -283,5 +380,4 @@ RetType NetworkInterface::QueueUDPMessage(const char* msg, size_t size) {
     return SUCCESS;
 }
 
-#undef MAX_MSG_SIZE
 #undef RECV_TIMEOUT
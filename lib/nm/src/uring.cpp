@@ -0,0 +1,277 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "lib/nm/uring.h"
+
+using namespace nm;
+
+#define URING_ENTRIES 8 // only ever one submission in flight
+#define URING_GROUP 0 // buffer group id of the provided buffers
+
+URing::URing(): ring_fd(-1), sockfd(-1), size(0), sq_ptr(MAP_FAILED), sq_len(0), sq_tail(NULL),
+                sq_mask(NULL), sq_array(NULL), sqes((struct io_uring_sqe*)MAP_FAILED), sqes_len(0),
+                cq_ptr(MAP_FAILED), cq_len(0), cq_head(NULL), cq_tail(NULL), cq_mask(NULL), cqes(NULL),
+                bufs((struct io_uring_buf_ring*)MAP_FAILED), bufs_len(0), pool(NULL), slot_size(0),
+                num_lent(0) {
+    memset(&msg, 0, sizeof(msg));
+}
+
+URing::~URing() {
+    Close();
+}
+
+RetType URing::Open(int sockfd, size_t size) {
+    if(ring_fd != -1) {
+        return SUCCESS;
+    }
+
+    this->sockfd = sockfd;
+    this->size = size;
+
+    // room for a completion from every buffer, so a burst never overflows the completion queue
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 2 * URING_BUFFERS;
+
+    ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if(ring_fd < 0) {
+        ring_fd = -1;
+        return FAILURE;
+    }
+
+    sq_len = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+    cq_len = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single) {
+        sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+    }
+
+    sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if(sq_ptr == MAP_FAILED) {
+        Close();
+        return FAILURE;
+    }
+
+    if(single) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if(cq_ptr == MAP_FAILED) {
+            Close();
+            return FAILURE;
+        }
+    }
+
+    sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*)mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      ring_fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        Close();
+        return FAILURE;
+    }
+
+    unsigned char* sq = (unsigned char*)sq_ptr;
+    sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + params.sq_off.array);
+
+    unsigned char* cq = (unsigned char*)cq_ptr;
+    cq_head = (unsigned*)(cq + params.cq_off.head);
+    cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // the buffer ring is shared with the kernel and has to be page aligned
+    bufs_len = URING_BUFFERS * sizeof(struct io_uring_buf);
+    bufs = (struct io_uring_buf_ring*)mmap(NULL, bufs_len, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(bufs == MAP_FAILED) {
+        Close();
+        return FAILURE;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)bufs;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_GROUP;
+    if(0 > syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        Close(); // older than 5.19
+        return FAILURE;
+    }
+
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_controllen = 0;
+
+    slot_size = sizeof(struct io_uring_recvmsg_out) + msg.msg_namelen + size;
+    pool = new unsigned char[URING_BUFFERS * slot_size];
+
+    uint16_t all[URING_BUFFERS];
+    for(size_t i = 0; i < URING_BUFFERS; i++) {
+        all[i] = i;
+    }
+    Provide(all, URING_BUFFERS);
+
+    if(FAILURE == Arm()) {
+        Close();
+        return FAILURE;
+    }
+
+    // a kernel without multishot recvmsg (older than 6.0) fails it as soon as it's submitted
+    unsigned head = *cq_head;
+    if(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) && cqes[head & *cq_mask].res < 0) {
+        Close();
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+void URing::Close() {
+    // closing the ring cancels the recvmsg, the kernel is done with the buffers after that
+    if(ring_fd != -1) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+
+    if(sqes != MAP_FAILED) {
+        munmap(sqes, sqes_len);
+        sqes = (struct io_uring_sqe*)MAP_FAILED;
+    }
+
+    if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_len);
+    }
+    cq_ptr = MAP_FAILED;
+
+    if(sq_ptr != MAP_FAILED) {
+        munmap(sq_ptr, sq_len);
+        sq_ptr = MAP_FAILED;
+    }
+
+    if(bufs != MAP_FAILED) {
+        munmap(bufs, bufs_len);
+        bufs = (struct io_uring_buf_ring*)MAP_FAILED;
+    }
+
+    if(pool) {
+        delete[] pool;
+        pool = NULL;
+    }
+
+    num_lent = 0;
+}
+
+int URing::Fd() {
+    return ring_fd;
+}
+
+RetType URing::Arm() {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+
+    struct io_uring_sqe* sqe = &(sqes[index]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sockfd;
+    sqe->addr = (uint64_t)&msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    sqe->msg_flags = MSG_TRUNC; // same as the socket, so we know if a datagram didn't fit
+
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if(1 != syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, NULL, 0)) {
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+void URing::Provide(uint16_t* bids, size_t n) {
+    uint16_t tail = bufs->tail;
+
+    // the entries start at the beginning of the ring, the tail overlaps the first one's reserved field
+    // (not bufs->bufs, in C++ the header's flexible array comes after an empty struct that takes up space)
+    struct io_uring_buf* entries = (struct io_uring_buf*)bufs;
+
+    for(size_t i = 0; i < n; i++) {
+        struct io_uring_buf* buf = &(entries[(tail + i) & (URING_BUFFERS - 1)]);
+        buf->addr = (uint64_t)(pool + (bids[i] * slot_size));
+        buf->len = slot_size;
+        buf->bid = bids[i];
+    }
+
+    // the kernel only looks at buffers before the tail
+    __atomic_store_n(&(bufs->tail), (uint16_t)(tail + n), __ATOMIC_RELEASE);
+}
+
+size_t URing::Receive(char** data, size_t* sizes, size_t max, struct sockaddr_in* from) {
+    if(ring_fd == -1) {
+        return 0;
+    }
+
+    // the caller is done with the last batch
+    Provide(lent, num_lent);
+    num_lent = 0;
+
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    bool stopped = false;
+    size_t count = 0;
+
+    while(head != tail && count < max) {
+        struct io_uring_cqe* cqe = &(cqes[head & *cq_mask]);
+        head++;
+
+        // the recvmsg stops if it runs out of buffers (or errors), it has to be submitted again
+        if(!(cqe->flags & IORING_CQE_F_MORE)) {
+            stopped = true;
+        }
+
+        if(!(cqe->flags & IORING_CQE_F_BUFFER)) {
+            continue;
+        }
+
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        lent[num_lent++] = bid;
+
+        if(cqe->res < 0) {
+            continue;
+        }
+
+        unsigned char* slot = pool + (bid * slot_size);
+        struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)slot;
+
+        // set the size to the size of the buffer if we received too much data for our buffer
+        size_t len = out->payloadlen;
+        if((out->flags & MSG_TRUNC) || len > size) {
+            len = size;
+        }
+
+        if(out->namelen >= sizeof(struct sockaddr_in)) {
+            memcpy(from, slot + sizeof(struct io_uring_recvmsg_out), sizeof(struct sockaddr_in));
+        }
+
+        data[count] = (char*)(slot + sizeof(struct io_uring_recvmsg_out) + msg.msg_namelen + msg.msg_controllen);
+        sizes[count] = len;
+        count++;
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    if(stopped) {
+        Arm(); // if this fails there's nothing to do but try again next time
+    }
+
+    return count;
+}
+
+#undef URING_ENTRIES
+#undef URING_GROUP
@@ -9,6 +9,9 @@
 *********************************************************************/
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -20,6 +23,14 @@
 #include <unistd.h>
 #include <limits.h>
 #include <sys/syscall.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <vector>
+#include <thread>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include "lib/shm/shm.h"
 #include "lib/vcm/vcm.h"
 #include "lib/dls/dls.h"
@@ -27,6 +38,23 @@
 
 // NOTE: shared memory can be manually altered with 'ipcs' and 'ipcrm' programs
 
+// where hugetlbfs is mounted, huge page backed POSIX shared memory is created here
+#define HUGEPAGE_DIR "/dev/hugepages"
+#define HUGEPAGE_SIZE (2 * 1024 * 1024) // default x86 huge page size
+
+// most ranges a writer remembers the measurements of, anything else is worked out on every write
+#define MAX_COVERAGE 256
+
+// how often the notifier thread behind Reader::get_fd checks if it should stop
+#define NOTIFY_POLL_INTERVAL 100000000 // 100ms
+
+// how often wait_any checks every reader if it can't sleep on all of them at once
+#define WAIT_ANY_POLL_INTERVAL 10000000 // 10ms
+
+// how long recover waits on rmutex or wmutex to give back a dead process's place in the reader or writer count
+// whoever holds it could have died without recording it, so don't wait forever
+#define RECOVER_TIMEOUT 1000 // ms
+
 // P and V semaphore macros
 #define P(X) \
     if(0 != sem_wait( &( (X) ) )) { \
@@ -38,6 +66,15 @@
         return FAILURE; \
     } \
 
+// P and V that also record the lock as held by this attachment (see Segment::recover)
+#define P_HELD(X, H) \
+    P(X) \
+    hold(H); \
+
+#define V_HELD(X, H) \
+    unhold(H); \
+    V(X) \
+
 // initialize semaphore macro
 #define INIT(X, V) \
     if(0 != sem_init( &( (X) ), 1, (V) )) { \
@@ -49,383 +86,427 @@ using namespace dls;
 
 namespace shm {
 
-    // VCM (for size and file name)
-    vcm::VCM* vcm = NULL;
-
-    // nonce to check for updates
-    unsigned int last_nonce = 0; // this will wrap around, but that's fine
+    // NOTE: loggers are only created when something goes wrong in the read and write paths,
+    //       creating one opens an mqueue which is far more expensive than the read or write itself
 
-    // info block for locking shared memory
+    // header of each slot in the history ring, the packet follows the header
+    // main shmem block is laid out as
+    // [packet][measurement write sequence numbers][slot 0 header][slot 0 packet][slot 1 header]...
     typedef struct {
-        uint32_t nonce;
-        unsigned int readers;
-        unsigned int writers;
-        sem_t rmutex;
-        sem_t wmutex;
-        sem_t readTry;
-        sem_t resource;
-    } shm_info_t;
+        uint32_t lock; // seqlock for this slot, odd while the slot is being written
+        uint32_t reserved;
+        uint64_t seq; // sequence number of the packet in this slot
+        uint64_t timestamp; // nanoseconds since epoch
+    } slot_header_t;
+
+    // round up to a multiple of 8 bytes so slot headers stay aligned
+    inline size_t align8(size_t size) {
+        return (size + 7) & ~((size_t)7);
+    }
 
-    // info block
-    shm_info_t* info = NULL;
-    int info_shmid = -1;
+    inline size_t slot_size(size_t packet_size) {
+        return sizeof(slot_header_t) + align8(packet_size);
+    }
 
-    // main shmem block
-    void* shmem = NULL;
-    int shmid = -1;
+    // the main shmem block is sized for the capacity set aside when it was created rather than
+    // the current layout, so a new layout can be published without moving anything
 
+    // one write sequence number per measurement, in the same order as vcm->measurements
+    inline size_t meas_seq_size(size_t meas_capacity) {
+        return meas_capacity * sizeof(uint64_t);
+    }
 
-    // reading and writing is done with *writers-preference*
-    // https://en.wikipedia.org/wiki/Readers%E2%80%93writers_problem
-    RetType write_to_shm(void* src, size_t size, size_t offset) {
-        MsgLogger logger("SHM", "write_to_shm");
+    inline uint64_t* meas_seq_table(shm_info_t* info, unsigned char* shmem) {
+        return (uint64_t*)(shmem + align8(info->packet_capacity));
+    }
 
-        if(!shmem || !info) {
-            logger.log_message("Not attached to shared memory, cannot write");
-            return FAILURE;
-        }
+    // bit of the wake group a measurement is in
+    inline uint32_t wake_group(vcm::handle_t handle) {
+        return 1u << (handle % WAKE_GROUPS);
+    }
 
-        if((size + offset) > vcm->packet_size) {
-            logger.log_message("Size to great to write to shared memory");
-            return FAILURE;
-        }
+    // size of the main shmem block
+    inline size_t block_size(size_t packet_capacity, size_t meas_capacity, size_t history_slots) {
+        return align8(packet_capacity) + meas_seq_size(meas_capacity) + (history_slots * slot_size(packet_capacity));
+    }
 
-        P(info->wmutex);
-        info->writers++;
-        if(info->writers == 1) {
-            P(info->readTry);
-        }
-        V(info->wmutex);
+    inline size_t block_size(shm_info_t* info) {
+        return block_size(info->packet_capacity, info->meas_capacity, info->history_slots);
+    }
 
-        P(info->resource);
+    inline slot_header_t* history_slot(shm_info_t* info, unsigned char* shmem, uint64_t seq) {
+        return (slot_header_t*)(shmem + align8(info->packet_capacity) + meas_seq_size(info->meas_capacity) +
+                                ((seq % info->history_slots) * slot_size(info->packet_capacity)));
+    }
 
-        memcpy((unsigned char*)shmem + offset, src, size);
-        info->nonce++; // update the nonce
-        syscall(SYS_futex, &(info->nonce), FUTEX_WAKE, INT_MAX, NULL, NULL, 0); // TODO check return
+    // seqlock helpers, only used in SEQLOCK_MODE
+    // https://en.wikipedia.org/wiki/Seqlock
+    // writers still exclude each other using the 'resource' semaphore, readers never touch it
+    inline void seq_write_begin(shm_info_t* info) {
+        __atomic_store_n(&(info->seq), info->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
 
-        V(info->resource);
+    inline void seq_write_end(shm_info_t* info) {
+        __atomic_store_n(&(info->seq), info->seq + 1, __ATOMIC_RELEASE);
+    }
 
-        P(info->wmutex);
-        info->writers--;
-        if(info->writers == 0) {
-            V(info->readTry);
+
+    // System V keys are made from the device name rather than with ftok on the config file,
+    // editing the config file can replace it (new inode) and the key has to stay the same
+    // for processes started after a new layout is published
+    // the hash only has 24 bits, so two devices can share a key, the device name is kept in the
+    // info block to catch that (see same_device)
+    inline key_t sysv_key(vcm::VCM* vcm, int proj_id) {
+        uint32_t hash = 2166136261; // FNV-1a
+        for(char c : vcm->device) {
+            hash ^= (unsigned char)c;
+            hash *= 16777619;
         }
-        V(info->wmutex);
+        return (key_t)((((uint32_t)proj_id & 0xff) << 24) | (hash & 0x00ffffff));
+    }
 
-        return SUCCESS;
+    // true if the info block was created for the same device as 'vcm'
+    inline bool same_device(shm_info_t* info, vcm::VCM* vcm) {
+        return strncmp(info->device, vcm->device.c_str(), MAX_DEVICE_NAME - 1) == 0;
     }
 
-    // reading and writing is done with *writers-preference*
-    // https://en.wikipedia.org/wiki/Readers%E2%80%93writers_problem
-    RetType read_from_shm(void* dst, size_t size, size_t offset) {
-        MsgLogger logger("SHM", "read_from_shm");
+    inline std::string device_of(shm_info_t* info) {
+        return std::string(info->device, strnlen(info->device, MAX_DEVICE_NAME));
+    }
 
-        if(!shmem || !info) {
-            logger.log_message("Not attached to shared memory, cannot read");
-            return FAILURE;
+    // names of POSIX shared memory objects, these show up under /dev/shm
+    // keyed by device name like the network manager's mqueue, not by the config file's inode
+    inline std::string posix_info_name(vcm::VCM* vcm) {
+        return "/" + vcm->device + "_shm_info";
+    }
+
+    inline std::string posix_name(vcm::VCM* vcm) {
+        return "/" + vcm->device + "_shm";
+    }
+
+    // huge page backed POSIX shared memory is a file on hugetlbfs rather than in /dev/shm
+    inline std::string hugepage_path(vcm::VCM* vcm) {
+        return HUGEPAGE_DIR + posix_name(vcm);
+    }
+
+    // fault in every page of a mapping by reading it
+    void populate(unsigned char* addr, size_t size) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        for(size_t i = 0; i < size; i += page_size) {
+            (void)*((volatile unsigned char*)(addr + i));
         }
+    }
 
-        if((size + offset) < vcm->packet_size) {
-            logger.log_message("Shared memory too large to read into destination buffer");
-            return FAILURE;
+    // map a POSIX shared memory object, returns NULL on failure
+    void* map_posix(int fd, size_t* size, int flags) {
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            return NULL;
         }
+        *size = st.st_size;
 
-        P(info->readTry);
-        P(info->rmutex);
-        info->readers++;
-        if(info->readers == 1) {
-            P(info->resource);
+        void* addr = mmap(NULL, *size, PROT_READ|PROT_WRITE, MAP_SHARED | flags, fd, 0);
+        if(addr == MAP_FAILED) {
+            return NULL;
         }
-        V(info->rmutex);
-        V(info->readTry);
 
-        memcpy(dst, (unsigned char*)shmem + offset, size);
-        last_nonce = info->nonce;
+        return addr;
+    }
 
-        P(info->rmutex);
-        info->readers--;
-        if(info->readers == 0) {
-            V(info->resource);
+
+    // sem_wait with a timeout in milliseconds, returns false if it timed out
+    bool timed_wait(sem_t* sem, long timeout) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline); // sem_timedwait only uses CLOCK_REALTIME
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
         }
-        V(info->rmutex);
 
-        return SUCCESS;
+        while(0 != sem_timedwait(sem, &deadline)) {
+            if(errno != EINTR) {
+                return false;
+            }
+        }
+        return true;
     }
 
-    RetType read_from_shm_if_updated(void* dst, size_t size, size_t offset) {
-        MsgLogger logger("SHM", "read_from_shm_if_updated");
 
-        RetType ret = SUCCESS;
+    Segment::Segment(): attached(false), vcm(NULL), info(NULL), shmem(NULL),
+                        meas_seq(NULL), info_shmid(-1), shmid(-1), posix(false), info_size(0),
+                        shmem_size(0), generation(0), bound(false), failed(false), failed_generation(0),
+                        holder(NULL) {
+        memset(&failed_mtime, 0, sizeof(failed_mtime));
+    }
 
-        if(!shmem || !info) {
-            logger.log_message("Not attached to shared memory, cannot read");
-            return FAILURE;
+    Segment::~Segment() {
+        if(attached) {
+            detach();
         }
+    }
 
-        if((size + offset) < vcm->packet_size) {
-            logger.log_message("Shared memory too large to read into destination buffer");
+    RetType Segment::attach(vcm::VCM* selected_vcm, int options) {
+        MsgLogger logger("SHM", "Segment::attach");
+
+        if(attached) {
+            logger.log_message("Already attached to shared memory");
             return FAILURE;
         }
 
-        P(info->readTry);
-        P(info->rmutex);
-        info->readers++;
-        if(info->readers == 1) {
-            P(info->resource);
+        vcm = selected_vcm;
+
+        RetType ret;
+        if(options & SHM_OPT_POSIX) {
+            ret = attach_posix();
+        } else if(options & SHM_OPT_SYSV) {
+            ret = attach_sysv();
+        } else {
+            // use POSIX shared memory if it was created for this vehicle, otherwise System V
+            int fd = shm_open(posix_info_name(vcm).c_str(), O_RDONLY, 0);
+            if(fd != -1) {
+                close(fd);
+                ret = attach_posix();
+            } else {
+                ret = attach_sysv();
+            }
         }
-        V(info->rmutex);
-        V(info->readTry);
 
-        if(last_nonce == info->nonce) { // no update
-            ret = FAILURE;
-        } else { // updated, do the read
-            memcpy(dst, (unsigned char*)shmem + offset, size);
-            last_nonce = info->nonce;
+        if(ret == FAILURE) {
+            if(info || shmem) {
+                detach();
+            }
+            return FAILURE;
         }
 
-        P(info->rmutex);
-        info->readers--;
-        if(info->readers == 0) {
-            V(info->resource);
+        // another device's shared memory with the same System V key
+        if(!same_device(info, vcm)) {
+            logger.log_message("Shared memory belongs to device " + device_of(info) + ", not " + vcm->device +
+                               " (their System V keys are the same, rename one of them)");
+            detach();
+            return FAILURE;
         }
-        V(info->rmutex);
 
-        return ret;
-    }
+        // options the shared memory was created with apply to every process
+        options |= info->options;
 
-    // TODO check if this causes deadlock
-    RetType read_from_shm_block(void* dst, size_t size, size_t offset) {
-        MsgLogger logger("SHM", "read_from_shm_block");
+        meas_seq = meas_seq_table(info, shmem);
 
-        if(!shmem || !info) {
-            logger.log_message("Not attached to shared memory, cannot read");
-            return FAILURE;
+        generation = __atomic_load_n(&(info->generation), __ATOMIC_ACQUIRE);
+        bound = (vcm->layout_hash() == info->layout_hash);
+        if(!bound) {
+            // still attach, the layout may be published soon (see shmctl -reload)
+            logger.log_message("Config file doesn't match the layout in shared memory, reads and writes will "
+                               "fail until it's published or shared memory is recreated");
         }
 
-        if((size + offset) < vcm->packet_size) {
-            logger.log_message("Shared memory too large to read into destination buffer");
-            return FAILURE;
+        if(options & SHM_OPT_POPULATE && !posix) { // POSIX shared memory is mapped with MAP_POPULATE
+            populate(shmem, shmem_size);
         }
 
-        int exit = 0;
-        //pthread_mutex_lock(&(info->nonce_lock)); // this is fake
-        while(!exit) {
-            // enter as a reader
-            P(info->readTry);
-            P(info->rmutex);
-            info->readers++;
-            if(info->readers == 1) {
-                P(info->resource);
-            }
-            V(info->rmutex);
-            V(info->readTry);
-
-            if(last_nonce == info->nonce) { // block
-                // leave as a reader
-                P(info->rmutex);
-                info->readers--;
-                if(info->readers == 0) {
-                    V(info->resource);
-                }
-                V(info->rmutex);
-
-                // we can guarantee no one changed the nonce so we can block until the nonce changes
-                // only the writer can change the nonce
-                // so block here
-                syscall(SYS_futex, &(info->nonce), FUTEX_WAIT, last_nonce, NULL, NULL, 0); // TODO check return
-            } else { // do the read
-                memcpy(dst, (unsigned char*)shmem + offset, size);
-                last_nonce = info->nonce;
-                exit = 1;
+        if(options & SHM_OPT_MLOCK) {
+            if(mlock(info, info_size) != 0 || mlock(shmem, shmem_size) != 0) {
+                // still usable, just not guaranteed to stay resident
+                logger.log_message("mlock failure, shared memory may be paged out");
             }
         }
 
-        // leave as a reader
-        P(info->rmutex);
-        info->readers--;
-        if(info->readers == 0) {
-            V(info->resource);
+        claim_holder();
+        if(!holder) {
+            logger.log_message("Too many attachments, locks held by this one can't be recovered if it dies");
         }
-        V(info->rmutex);
 
+        attached = true;
         return SUCCESS;
     }
 
-    // locking works the same as write
-    RetType clear_shm() {
-        MsgLogger logger("SHM", "clear_shm");
-
-        if(!shmem || !info) {
-            logger.log_message("Not attached to shared memory, cannot clear");
-            return FAILURE;
-        }
+    // true if 'pid' is a process that no longer exists
+    inline bool dead(int32_t pid) {
+        return kill(pid, 0) != 0 && errno == ESRCH;
+    }
 
-        P(info->wmutex);
-        info->writers++;
-        if(info->writers == 1) {
-            P(info->readTry);
-        }
-        V(info->wmutex);
-        P(info->resource);
+    // take a free entry in info->holders, or one left by a dead process that wasn't holding anything
+    void Segment::claim_holder() {
+        int32_t pid = getpid();
+        holder = NULL;
 
-        memset(shmem, 0, vcm->packet_size);
-        info->nonce++; // update the nonce
-        syscall(SYS_futex, &(info->nonce), FUTEX_WAKE, INT_MAX, NULL, NULL, 0); // TODO check return
+        for(size_t i = 0; i < MAX_LOCK_HOLDERS; i++) {
+            lock_holder_t* entry = &(info->holders[i]);
+            int32_t owner = __atomic_load_n(&(entry->pid), __ATOMIC_ACQUIRE);
 
-        V(info->resource);
+            // -1 while recover is releasing a dead process's locks
+            if(owner != 0 && (owner == -1 || __atomic_load_n(&(entry->held), __ATOMIC_ACQUIRE) != 0 ||
+                              !dead(owner))) {
+                continue;
+            }
 
-        P(info->wmutex);
-        info->writers--;
-        if(info->writers == 0) {
-            V(info->readTry);
+            if(__atomic_compare_exchange_n(&(entry->pid), &owner, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                holder = entry;
+                return;
+            }
         }
-        V(info->wmutex);
-
-        return SUCCESS;
     }
 
-    size_t get_shmem_size() {
-        if(vcm) {
-            return vcm->packet_size;
+    // give back this attachment's entry in info->holders
+    // if it's somehow still holding locks, leave them recorded so they can be recovered once this process exits
+    void Segment::release_holder() {
+        if(holder && __atomic_load_n(&(holder->held), __ATOMIC_ACQUIRE) == 0) {
+            __atomic_store_n(&(holder->pid), 0, __ATOMIC_RELEASE);
         }
-        return 0;
+        holder = NULL;
     }
 
-    RetType create_shm(vcm::VCM* vcm) {
-        MsgLogger logger("SHM", "create_shm");
+    RetType Segment::attach_sysv() {
+        MsgLogger logger("SHM", "Segment::attach_sysv");
 
-        // create info shmem
-        key_t info_key = ftok(vcm->config_file.c_str(), info_id);
-        if(info_key == (key_t) -1) {
-            logger.log_message("ftok failure, no key generated for info shmem");
-            return FAILURE;
-        }
+        key_t info_key = sysv_key(vcm, info_id);
 
-        info_shmid = shmget(info_key, sizeof(shm_info_t),
-                            0666|IPC_CREAT|IPC_EXCL);
+        info_shmid = shmget(info_key, sizeof(shm_info_t), 0666);
         if(info_shmid == -1) {
             logger.log_message("shmget failure for info shmem");
             return FAILURE;
         }
 
-        // briefly attach to info shmem
         info = (shm_info_t*) shmat(info_shmid, (void*)0, 0);
         if(info == (void*) -1) {
             info = NULL;
             logger.log_message("shmat failure, cannot attach to info shmem");
             return FAILURE;
         }
+        info_size = sizeof(shm_info_t);
 
-        // init semaphores
-        INIT(info->rmutex, 1);
-        INIT(info->wmutex, 1);
-        INIT(info->readTry, 1);
-        INIT(info->resource, 1);
-
-        // init reader/writer counts to 0
-        info->readers = 0;
-        info->writers = 0;
-
-        // start the nonce at 0
-        info->nonce = 0;
-
-        // detach from info shmem
-        if(shmdt(info) != 0) {
-            logger.log_message("shmdt failure, failed to detach from info shmem");
-            return FAILURE;
-        }
-        info = NULL;
+        key_t key = sysv_key(vcm, id);
 
-        // set up shmem
-        key_t key = ftok(vcm->config_file.c_str(), id);
-        if(key == (key_t) -1) {
-            logger.log_message("ftok failure, no key generated");
+        shmem_size = block_size(info);
+        shmid = shmget(key, shmem_size, 0666);
+        if(shmid == -1) {
+            logger.log_message("shmget failure");
             return FAILURE;
         }
 
-        // shmid = shmget(key, vcm->packet_size, 0666|IPC_CREAT|IPC_EXCL);
-        shmid = shmget(key, vcm->packet_size, 0666|IPC_CREAT|IPC_EXCL);
-        if(shmid == -1) {
-            logger.log_message("shmget failure");
+        shmem = (unsigned char*) shmat(shmid, (void*)0, 0);
+        if(shmem == (void*) -1) {
+            shmem = NULL;
+            logger.log_message("shmat failure");
             return FAILURE;
         }
 
+        posix = false;
         return SUCCESS;
     }
 
-    RetType attach_to_shm(vcm::VCM* selected_vcm) {
-        MsgLogger logger("SHM", "attach_to_shm");
+    RetType Segment::attach_posix() {
+        MsgLogger logger("SHM", "Segment::attach_posix");
 
-        vcm = new vcm::VCM(*selected_vcm); // copy the VCM
+        posix = true;
 
-        key_t info_key = ftok(vcm->config_file.c_str(), info_id);
-        if(info_key == (key_t) -1) {
-            logger.log_message("ftok failure, no key generated for info shmem");
+        int fd = shm_open(posix_info_name(vcm).c_str(), O_RDWR, 0);
+        if(fd == -1) {
+            logger.log_message("shm_open failure for info shmem");
             return FAILURE;
         }
 
-        info_shmid = shmget(info_key, sizeof(shm_info_t), 0666);
-        if(info_shmid == -1) {
-            logger.log_message("shmget failure for info shmem");
+        info = (shm_info_t*) map_posix(fd, &info_size, 0);
+        close(fd);
+        if(!info) {
+            logger.log_message("mmap failure, cannot attach to info shmem");
             return FAILURE;
         }
 
-        info = (shm_info_t*) shmat(info_shmid, (void*)0, 0);
-        if(info == (void*) -1) {
-            info = NULL;
-            logger.log_message("shmat failure, cannot attach to info shmem");
-            return FAILURE;
+        int flags = 0;
+        if(info->options & SHM_OPT_POPULATE) {
+            flags |= MAP_POPULATE;
         }
 
-        key_t key = ftok(vcm->config_file.c_str(), id);
-        if(key == (key_t) -1) {
-            logger.log_message("ftok failure, no key generated");
-            return FAILURE;
+        if(info->options & SHM_OPT_HUGEPAGES) {
+            fd = open(hugepage_path(vcm).c_str(), O_RDWR);
+            flags |= MAP_HUGETLB;
+        } else {
+            fd = shm_open(posix_name(vcm).c_str(), O_RDWR, 0);
         }
 
-        shmid = shmget(key, vcm->packet_size, 0666);
-        if(shmid == -1) {
-            logger.log_message("shmget failure");
+        if(fd == -1) {
+            logger.log_message("shm_open failure");
             return FAILURE;
         }
 
-        shmem = shmat(shmid, (void*)0, 0);
-        if(shmem == (void*) -1) {
-            shmem = NULL;
-            logger.log_message("shmat failure");
+        shmem = (unsigned char*) map_posix(fd, &shmem_size, flags);
+        close(fd);
+        if(!shmem) {
+            logger.log_message("mmap failure");
             return FAILURE;
         }
 
         return SUCCESS;
     }
 
-    RetType detach_from_shm() {
-        MsgLogger logger("SHM", "detach_from_shm");
+    RetType Segment::detach() {
+        MsgLogger logger("SHM", "Segment::detach");
+
+        RetType ret = SUCCESS;
+
+        if(!info && !shmem) {
+            logger.log_message("Not attached to shared memory, nothing to detach");
+            return FAILURE;
+        }
 
         if(info) {
-            if(shmdt(info) != 0) {
-                logger.log_message("shmdt failure for info shmem");
-                return FAILURE;
+            release_holder();
+
+            if((posix ? munmap(info, info_size) : shmdt(info)) != 0) {
+                logger.log_message("failed to detach from info shmem");
+                ret = FAILURE;
             }
             info = NULL;
         }
 
+        meas_seq = NULL;
+
         if(shmem) {
-            if(shmdt(shmem) == 0) {
-                shmem = NULL;
-                vcm = NULL;
-                return SUCCESS;
+            if((posix ? munmap(shmem, shmem_size) : shmdt(shmem)) != 0) {
+                logger.log_message("failed to detach from shmem");
+                ret = FAILURE;
             }
+            shmem = NULL;
         }
-        logger.log_message("shmdt failure");
-        return FAILURE;
+
+        attached = false;
+        return ret;
     }
 
-    RetType destroy_shm() {
-        MsgLogger logger("SHM", "destroy_shm");
+    RetType Segment::destroy() {
+        MsgLogger logger("SHM", "Segment::destroy");
 
         RetType ret = SUCCESS;
 
+        if(!info) {
+            logger.log_message("No shmem to destroy");
+            return FAILURE;
+        }
+
+        if(posix) {
+            if(shm_unlink(posix_info_name(vcm).c_str()) != 0) {
+                logger.log_message("shm_unlink failure for info shmem");
+                ret = FAILURE;
+            }
+
+            int rc;
+            if(info->options & SHM_OPT_HUGEPAGES) {
+                rc = unlink(hugepage_path(vcm).c_str());
+            } else {
+                rc = shm_unlink(posix_name(vcm).c_str());
+            }
+
+            if(rc != 0) {
+                logger.log_message("shm_unlink failure");
+                ret = FAILURE;
+            }
+
+            return ret;
+        }
+
         if(shmid == -1 || info_shmid == -1) {
             logger.log_message("No shmem to destroy");
             ret = FAILURE;
@@ -436,7 +517,6 @@ namespace shm {
             ret = FAILURE;
         } else {
             info_shmid = -1;
-            info = NULL;
         }
 
         if(shmctl(shmid, IPC_RMID, NULL) == -1) {
@@ -444,12 +524,1873 @@ namespace shm {
             ret = FAILURE;
         } else {
             shmid = -1;
-            shmem = NULL;
         }
 
-        // only reset vcm if
-        if(ret == SUCCESS) {
-            vcm = NULL;
+        return ret;
+    }
+
+    size_t Segment::get_size() {
+        if(vcm) {
+            return vcm->packet_size;
+        }
+        return 0;
+    }
+
+    bool Segment::layout_changed() {
+        if(!attached) {
+            return false;
+        }
+
+        return stale();
+    }
+
+    RetType Segment::rebind() {
+        if(!attached) {
+            MsgLogger logger("SHM", "Segment::rebind");
+            logger.log_message("Not attached to shared memory, cannot rebind");
+            return FAILURE;
+        }
+
+        // the layout is published before the generation, so this hash goes with this generation
+        // unless another layout was published in between, then try again
+        uint32_t gen;
+        uint64_t hash;
+        do {
+            gen = __atomic_load_n(&(info->generation), __ATOMIC_ACQUIRE);
+            hash = info->layout_hash;
+        } while(__atomic_load_n(&(info->generation), __ATOMIC_ACQUIRE) != gen);
+
+        // callers retry until this works, so a layout the config file already didn't match isn't
+        // tried (or logged) again until the config file is edited or another layout is published
+        struct stat config;
+        if(stat(vcm->config_file.c_str(), &config) != 0) {
+            memset(&config, 0, sizeof(config));
+        }
+
+        if(failed && gen == failed_generation && config.st_mtim.tv_sec == failed_mtime.tv_sec &&
+           config.st_mtim.tv_nsec == failed_mtime.tv_nsec) {
+            return FAILURE;
+        }
+
+        std::string why = "";
+
+        // another attachment sharing the VCM may have already reloaded it
+        if(vcm->layout_hash() != hash) {
+            // make sure the config file matches before touching the VCM, so on failure the
+            // caller's measurement info is still good
+            vcm::VCM* fresh = NULL;
+            try {
+                fresh = new vcm::VCM(vcm->config_file);
+            } catch(const std::runtime_error* e) {
+                why = "Failed to load config file: " + vcm->config_file;
+            }
+
+            if(fresh) {
+                bool matches = (fresh->layout_hash() == hash);
+                bool same_device = (fresh->device == vcm->device);
+                delete fresh;
+
+                if(!same_device) {
+                    why = "Device name changed, shared memory has to be recreated";
+                } else if(!matches) {
+                    why = "Config file doesn't match the published layout: " + vcm->config_file;
+                } else if(FAILURE == vcm->reload() || vcm->layout_hash() != hash) {
+                    why = "Failed to reload config file: " + vcm->config_file;
+                }
+            }
+        }
+
+        if(why != "") {
+            failed = true;
+            failed_generation = gen;
+            failed_mtime = config.st_mtim;
+
+            MsgLogger logger("SHM", "Segment::rebind");
+            logger.log_message(why);
+            return FAILURE;
+        }
+
+        failed = false;
+        generation = gen;
+        bound = true;
+        return SUCCESS;
+    }
+
+    size_t Segment::get_history_slots() {
+        if(info) {
+            return info->history_slots;
+        }
+        return 0;
+    }
+
+    uint32_t Segment::get_generation() {
+        if(info) {
+            return __atomic_load_n(&(info->generation), __ATOMIC_ACQUIRE);
+        }
+        return 0;
+    }
+
+    // give back every lock a dead process held, as if it had finished what it was doing
+    // the dead process's entry must already be claimed by the caller
+    // what's given back is cleared from the entry as it goes, so on failure it can be tried again
+    RetType Segment::release_dead(lock_holder_t* dead) {
+        uint32_t held = __atomic_load_n(&(dead->held), __ATOMIC_ACQUIRE);
+
+        // the writer died in the middle of a write, let readers see the packet as is
+        if(held & HELD_RESOURCE) {
+            if(info->mode == SEQLOCK_MODE) {
+                uint32_t seq = __atomic_load_n(&(info->seq), __ATOMIC_ACQUIRE);
+                if(seq & 1) {
+                    __atomic_store_n(&(info->seq), seq + 1, __ATOMIC_RELEASE);
+                }
+            }
+
+            if(info->history_slots) {
+                slot_header_t* slot = history_slot(info, shmem, info->history_seq + 1);
+                uint32_t lock = __atomic_load_n(&(slot->lock), __ATOMIC_ACQUIRE);
+                if(lock & 1) {
+                    __atomic_store_n(&(slot->lock), lock + 1, __ATOMIC_RELEASE);
+                }
+            }
+
+            held &= ~HELD_RESOURCE;
+            __atomic_store_n(&(dead->held), held, __ATOMIC_RELEASE);
+            V(info->resource);
+        }
+
+        if(held & HELD_READTRY) {
+            held &= ~HELD_READTRY;
+            __atomic_store_n(&(dead->held), held, __ATOMIC_RELEASE);
+            V(info->readTry);
+        }
+
+        // it had the reader count to itself if it held rmutex, leave as a reader for it
+        if(held & (HELD_READER | HELD_RMUTEX)) {
+            if(!(held & HELD_RMUTEX) && !timed_wait(&(info->rmutex), RECOVER_TIMEOUT)) {
+                return FAILURE;
+            }
+
+            if(held & HELD_READER) {
+                info->readers--;
+                if(info->readers == 0) {
+                    V(info->resource);
+                }
+            }
+
+            held &= ~(HELD_READER | HELD_RMUTEX);
+            __atomic_store_n(&(dead->held), held, __ATOMIC_RELEASE);
+            V(info->rmutex);
+        }
+
+        // same for the writer count
+        if(held & (HELD_WRITER | HELD_WMUTEX)) {
+            if(!(held & HELD_WMUTEX) && !timed_wait(&(info->wmutex), RECOVER_TIMEOUT)) {
+                return FAILURE;
+            }
+
+            if(held & HELD_WRITER) {
+                info->writers--;
+                if(info->writers == 0) {
+                    V(info->readTry);
+                }
+            }
+
+            held &= ~(HELD_WRITER | HELD_WMUTEX);
+            __atomic_store_n(&(dead->held), held, __ATOMIC_RELEASE);
+            V(info->wmutex);
+        }
+
+        return SUCCESS;
+    }
+
+    RetType Segment::recover(bool* recovered) {
+        MsgLogger logger("SHM", "Segment::recover");
+
+        *recovered = false;
+
+        if(!attached) {
+            logger.log_message("Not attached to shared memory, cannot recover");
+            return FAILURE;
+        }
+
+        // claim the entries of dead processes first so no one else recovers them too
+        lock_holder_t* dead_holders[MAX_LOCK_HOLDERS];
+        int32_t dead_pids[MAX_LOCK_HOLDERS];
+        size_t num_dead = 0;
+
+        for(size_t i = 0; i < MAX_LOCK_HOLDERS; i++) {
+            lock_holder_t* entry = &(info->holders[i]);
+            int32_t pid = __atomic_load_n(&(entry->pid), __ATOMIC_ACQUIRE);
+            if(pid <= 0 || !dead(pid)) {
+                continue;
+            }
+
+            if(__atomic_compare_exchange_n(&(entry->pid), &pid, -1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                dead_holders[num_dead] = entry;
+                dead_pids[num_dead] = pid;
+                num_dead++;
+            }
+        }
+
+        // anyone that died holding rmutex or wmutex goes first, releasing someone else's place in
+        // the reader or writer count waits on them
+        RetType ret = SUCCESS;
+        for(int pass = 0; pass < 2; pass++) {
+            for(size_t i = 0; i < num_dead; i++) {
+                uint32_t held = __atomic_load_n(&(dead_holders[i]->held), __ATOMIC_ACQUIRE);
+                bool mutex = held & (HELD_RMUTEX | HELD_WMUTEX);
+                if(held == 0 || (pass == 0) != mutex) {
+                    continue;
+                }
+
+                if(FAILURE == release_dead(dead_holders[i])) {
+                    logger.log_message("failed to release locks held by dead process " +
+                                       std::to_string(dead_pids[i]));
+                    ret = FAILURE;
+                    continue;
+                }
+
+                logger.log_message("released locks held by dead process " + std::to_string(dead_pids[i]));
+                *recovered = true;
+            }
+        }
+
+        // free the entries, unless they still have locks to release
+        for(size_t i = 0; i < num_dead; i++) {
+            if(__atomic_load_n(&(dead_holders[i]->held), __ATOMIC_ACQUIRE) == 0) {
+                __atomic_store_n(&(dead_holders[i]->pid), 0, __ATOMIC_RELEASE);
+            } else {
+                __atomic_store_n(&(dead_holders[i]->pid), dead_pids[i], __ATOMIC_RELEASE);
+            }
+        }
+
+        return ret;
+    }
+
+
+    // copy the whole packet into the next slot of the history ring
+    // must be called while holding writer exclusion
+    void Writer::record_history() {
+        if(info->history_slots == 0) {
+            return;
+        }
+
+        uint64_t seq = info->history_seq + 1;
+        slot_header_t* slot = history_slot(info, shmem, seq);
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        __atomic_store_n(&(slot->lock), slot->lock + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        slot->seq = seq;
+        slot->timestamp = ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+        memcpy((unsigned char*)slot + sizeof(slot_header_t), shmem, vcm->packet_size);
+
+        __atomic_store_n(&(slot->lock), slot->lock + 1, __ATOMIC_RELEASE);
+
+        // publish the packet
+        __atomic_store_n(&(info->history_seq), seq, __ATOMIC_RELEASE);
+    }
+
+    RetType Writer::attach(vcm::VCM* vcm, int options) {
+        if(FAILURE == Segment::attach(vcm, options)) {
+            return FAILURE;
+        }
+
+        index_ranges();
+        return SUCCESS;
+    }
+
+    RetType Writer::rebind() {
+        if(FAILURE == Segment::rebind()) {
+            return FAILURE;
+        }
+
+        // the VCM may have been reloaded, by this writer or another attachment sharing it
+        index_ranges();
+        return SUCCESS;
+    }
+
+    // work out which measurements the ranges write_packet and clear write overlap ahead of time,
+    // so writes don't have to check every measurement
+    void Writer::index_ranges() {
+        coverage.clear();
+
+        cover(vcm->packet_size, 0);
+
+        if(vcm->num_packet_types) {
+            cover(vcm->header_size, 0);
+
+            vcm::packet_type_t* types = vcm->get_packet_types();
+            for(size_t i = 0; i < vcm->num_packet_types; i++) {
+                cover(types[i].size, types[i].addr);
+            }
+        } else {
+            cover(vcm->recv_size, 0);
+        }
+
+        if(vcm->num_derived > 0) {
+            cover(vcm->num_derived * sizeof(double), vcm->derived_addr);
+        }
+    }
+
+    // get the measurements 'size' bytes at 'offset' overlap, working them out the first time
+    Writer::coverage_t* Writer::cover(size_t size, size_t offset) {
+        std::pair<size_t, size_t> key(offset, size);
+
+        auto it = coverage.find(key);
+        if(it != coverage.end()) {
+            return &(it->second);
+        }
+
+        coverage_t* c = &uncached;
+        if(coverage.size() < MAX_COVERAGE) {
+            c = &(coverage[key]);
+        }
+
+        c->handles.clear();
+        c->groups = 0;
+        for(vcm::handle_t i = 0; i < vcm->measurements.size(); i++) {
+            vcm::measurement_info_t* m_info = vcm->get_info(i);
+            size_t addr = (size_t)m_info->addr;
+            if(addr < offset + size && addr + m_info->size > offset) {
+                c->handles.push_back(i);
+                c->groups |= wake_group(i);
+            }
+        }
+
+        return c;
+    }
+
+    // record which measurements a write touched
+    // must be called while holding writer exclusion, before the nonce is updated
+    // returns the bitset of wake groups the write touched
+    uint32_t Writer::mark_written(size_t size, size_t offset) {
+        uint64_t seq = info->write_seq + 1;
+
+        coverage_t* c = cover(size, offset);
+        for(vcm::handle_t handle : c->handles) {
+            meas_seq[handle] = seq;
+        }
+        uint32_t groups = c->groups;
+
+        // the nonce this write is about to publish
+        uint32_t nonce = info->nonce + 1;
+        for(size_t g = 0; g < WAKE_GROUPS; g++) {
+            if(groups & (1u << g)) {
+                __atomic_store_n(&(info->group_nonce[g]), nonce, __ATOMIC_RELAXED);
+            }
+        }
+
+        __atomic_store_n(&(info->write_seq), seq, __ATOMIC_RELEASE);
+
+        return groups;
+    }
+
+    // wake every reader waiting on any of 'groups'
+    // a write that didn't touch any measurement wakes everyone, they'll check for themselves
+    inline void wake(shm_info_t* info, uint32_t groups) {
+        if(groups == 0) {
+            groups = FUTEX_BITSET_MATCH_ANY;
+        }
+        syscall(SYS_futex, &(info->nonce), FUTEX_WAKE_BITSET, INT_MAX, NULL, NULL, groups); // TODO check return
+    }
+
+    // enter as a writer in LOCK_MODE
+    // readers hold readTry and resource, so only wait on them for so long in case one died holding them
+    // the count only goes up once readTry is held, so a dead writer's place in it can be given back
+    RetType Writer::lock() {
+        P_HELD(info->wmutex, HELD_WMUTEX);
+        if(info->writers == 0) {
+            if(!timed_wait(&(info->readTry), WRITE_TIMEOUT)) {
+                V_HELD(info->wmutex, HELD_WMUTEX);
+                return FAILURE;
+            }
+        }
+        info->writers++;
+        hold(HELD_WRITER);
+        V_HELD(info->wmutex, HELD_WMUTEX);
+
+        if(!timed_wait(&(info->resource), WRITE_TIMEOUT)) {
+            P_HELD(info->wmutex, HELD_WMUTEX);
+            unhold(HELD_WRITER);
+            info->writers--;
+            if(info->writers == 0) {
+                V(info->readTry);
+            }
+            V_HELD(info->wmutex, HELD_WMUTEX);
+            return FAILURE;
+        }
+        hold(HELD_RESOURCE);
+
+        return SUCCESS;
+    }
+
+    // take writer exclusion in SEQLOCK_MODE
+    // writers only hold it for a copy, so waiting longer than WRITE_TIMEOUT means another writer died
+    // in the middle of a write (or is stopped), release the locks of dead writers and wait once more
+    RetType Writer::seq_lock() {
+        if(!timed_wait(&(info->resource), WRITE_TIMEOUT)) {
+            bool recovered = false;
+            recover(&recovered); // another writer may have recovered it already, so wait either way
+
+            if(!timed_wait(&(info->resource), WRITE_TIMEOUT)) {
+                return FAILURE;
+            }
+        }
+        hold(HELD_RESOURCE);
+
+        return SUCCESS;
+    }
+
+    // leave as a writer in LOCK_MODE
+    RetType Writer::unlock() {
+        V_HELD(info->resource, HELD_RESOURCE);
+
+        P_HELD(info->wmutex, HELD_WMUTEX);
+        unhold(HELD_WRITER);
+        info->writers--;
+        if(info->writers == 0) {
+            V(info->readTry);
+        }
+        V_HELD(info->wmutex, HELD_WMUTEX);
+
+        return SUCCESS;
+    }
+
+    RetType Writer::write(void* src, size_t size, size_t offset) {
+        range_t range = {src, size, offset};
+        return write_ranges(&range, 1);
+    }
+
+    // write a received packet, and its derived measurements if there are any
+    // everything is written together, so readers never see part of a packet or derived measurements
+    // that don't go with it
+    RetType Writer::write_packet(const unsigned char* packet, vcm::packet_type_t* type, bool derived) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Writer::write_packet");
+            logger.log_message("Not attached to shared memory, cannot write");
+            return FAILURE;
+        }
+
+        range_t ranges[3];
+        size_t n = 0;
+
+        if(type) {
+            // the header, then the type's measurements (see vcm::packet_type_t)
+            ranges[n++] = {packet, vcm->header_size, 0};
+            ranges[n++] = {packet + type->addr, (size_t)type->size, (size_t)type->addr};
+        } else {
+            ranges[n++] = {packet, vcm->recv_size, 0};
+        }
+
+        if(derived && vcm->num_derived > 0) {
+            ranges[n++] = {packet + vcm->derived_addr, vcm->num_derived * sizeof(double), vcm->derived_addr};
+        }
+
+        return write_ranges(ranges, n);
+    }
+
+    // copy every range in as one write
+    // reading and writing is done with *writers-preference*
+    // https://en.wikipedia.org/wiki/Readers%E2%80%93writers_problem
+    RetType Writer::write_ranges(const range_t* ranges, size_t n) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Writer::write");
+            logger.log_message("Not attached to shared memory, cannot write");
+            return FAILURE;
+        }
+
+        for(size_t i = 0; i < n; i++) {
+            if((ranges[i].size + ranges[i].offset) > vcm->packet_size) {
+                MsgLogger logger("SHM", "Writer::write");
+                logger.log_message("Size to great to write to shared memory");
+                return FAILURE;
+            }
+        }
+
+        if(info->mode == SEQLOCK_MODE) {
+            if(FAILURE == seq_lock()) {
+                MsgLogger logger("SHM", "Writer::write");
+                logger.log_message("Timed out waiting on another writer, it may have died holding the lock");
+                return FAILURE;
+            }
+
+            // a new layout can only be published while holding writer exclusion
+            if(stale()) {
+                V_HELD(info->resource, HELD_RESOURCE);
+                MsgLogger logger("SHM", "Writer::write");
+                logger.log_message("Layout changed, rebind before writing");
+                return FAILURE;
+            }
+
+            seq_write_begin(info);
+            uint32_t groups = copy_ranges(ranges, n);
+            record_history(); // before the nonce, anyone who sees the new nonce can find the packet
+            __atomic_add_fetch(&(info->nonce), 1, __ATOMIC_RELEASE); // update the nonce
+            seq_write_end(info);
+
+            wake(info, groups);
+
+            V_HELD(info->resource, HELD_RESOURCE);
+            return SUCCESS;
+        }
+
+        if(FAILURE == lock()) {
+            MsgLogger logger("SHM", "Writer::write");
+            logger.log_message("Timed out waiting on readers, one may have died holding the lock (see shmctl -recover)");
+            return FAILURE;
+        }
+
+        if(stale()) {
+            unlock();
+            MsgLogger logger("SHM", "Writer::write");
+            logger.log_message("Layout changed, rebind before writing");
+            return FAILURE;
+        }
+
+        uint32_t groups = copy_ranges(ranges, n);
+        record_history(); // before the nonce, anyone who sees the new nonce can find the packet
+        __atomic_add_fetch(&(info->nonce), 1, __ATOMIC_RELEASE); // update the nonce
+        wake(info, groups);
+
+        return unlock();
+    }
+
+    // must be called while holding writer exclusion
+    // returns the bitset of wake groups the ranges touched
+    uint32_t Writer::copy_ranges(const range_t* ranges, size_t n) {
+        uint32_t groups = 0;
+        for(size_t i = 0; i < n; i++) {
+            if(ranges[i].size == 0) {
+                continue;
+            }
+            memcpy(shmem + ranges[i].offset, ranges[i].src, ranges[i].size);
+            groups |= mark_written(ranges[i].size, ranges[i].offset);
+        }
+        return groups;
+    }
+
+    // locking works the same as write
+    RetType Writer::clear() {
+        if(!attached) {
+            MsgLogger logger("SHM", "Writer::clear");
+            logger.log_message("Not attached to shared memory, cannot clear");
+            return FAILURE;
+        }
+
+        if(info->mode == SEQLOCK_MODE) {
+            if(FAILURE == seq_lock()) {
+                MsgLogger logger("SHM", "Writer::clear");
+                logger.log_message("Timed out waiting on another writer, it may have died holding the lock");
+                return FAILURE;
+            }
+
+            if(stale()) {
+                V_HELD(info->resource, HELD_RESOURCE);
+                MsgLogger logger("SHM", "Writer::clear");
+                logger.log_message("Layout changed, rebind before clearing");
+                return FAILURE;
+            }
+
+            seq_write_begin(info);
+            memset(shmem, 0, vcm->packet_size);
+            uint32_t groups = mark_written(vcm->packet_size, 0);
+            __atomic_add_fetch(&(info->nonce), 1, __ATOMIC_RELAXED); // update the nonce
+            seq_write_end(info);
+
+            wake(info, groups);
+
+            V_HELD(info->resource, HELD_RESOURCE);
+            return SUCCESS;
+        }
+
+        if(FAILURE == lock()) {
+            MsgLogger logger("SHM", "Writer::clear");
+            logger.log_message("Timed out waiting on readers, one may have died holding the lock (see shmctl -recover)");
+            return FAILURE;
+        }
+
+        if(stale()) {
+            unlock();
+            MsgLogger logger("SHM", "Writer::clear");
+            logger.log_message("Layout changed, rebind before clearing");
+            return FAILURE;
+        }
+
+        memset(shmem, 0, vcm->packet_size);
+        uint32_t groups = mark_written(vcm->packet_size, 0);
+        info->nonce++; // update the nonce
+        wake(info, groups);
+
+        return unlock();
+    }
+
+    // must be called while holding writer exclusion
+    void Writer::swap_layout() {
+        // nothing written in the old layout means anything in the new one
+        memset(shmem, 0, info->packet_capacity);
+        memset(meas_seq, 0, meas_seq_size(info->meas_capacity));
+        info->layout_history_seq = info->history_seq;
+
+        info->layout_hash = vcm->layout_hash();
+        __atomic_store_n(&(info->generation), info->generation + 1, __ATOMIC_RELEASE);
+
+        // every reader has something new to look at, subscribed or not
+        uint32_t nonce = info->nonce + 1;
+        for(size_t g = 0; g < WAKE_GROUPS; g++) {
+            __atomic_store_n(&(info->group_nonce[g]), nonce, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&(info->nonce), nonce, __ATOMIC_RELEASE);
+
+        generation = info->generation;
+        bound = true;
+    }
+
+    // locking works the same as write
+    RetType Writer::publish() {
+        MsgLogger logger("SHM", "Writer::publish");
+
+        if(!attached) {
+            logger.log_message("Not attached to shared memory, cannot publish a layout");
+            return FAILURE;
+        }
+
+        if(vcm->packet_size > info->packet_capacity || vcm->measurements.size() > info->meas_capacity) {
+            logger.log_message("Layout doesn't fit in shared memory, recreate it with more space reserved");
+            return FAILURE;
+        }
+
+        // the VCM was reloaded with the new layout, work out its ranges before taking the lock
+        index_ranges();
+
+        if(info->mode == SEQLOCK_MODE) {
+            if(FAILURE == seq_lock()) {
+                logger.log_message("Timed out waiting on another writer, it may have died holding the lock");
+                return FAILURE;
+            }
+
+            seq_write_begin(info);
+            swap_layout();
+            seq_write_end(info);
+
+            wake(info, FUTEX_BITSET_MATCH_ANY);
+
+            V_HELD(info->resource, HELD_RESOURCE);
+            return SUCCESS;
+        }
+
+        if(FAILURE == lock()) {
+            logger.log_message("Timed out waiting on readers, one may have died holding the lock (see shmctl -recover)");
+            return FAILURE;
+        }
+
+        swap_layout();
+        wake(info, FUTEX_BITSET_MATCH_ANY);
+
+        return unlock();
+    }
+
+
+    // reads that find the layout changed fail without counting as a read, so after rebinding
+    // the same update can still be read
+    RetType stale_failure(const char* where) {
+        MsgLogger logger("SHM", where);
+        logger.log_message("Layout changed, rebind before reading");
+        return FAILURE;
+    }
+
+    Reader::Reader(): Segment(), last_nonce(0), last_history_seq(0), last_write_seq(0),
+                      wake_mask(FUTEX_BITSET_MATCH_ANY), notify_fd(-1), notifying(false) {}
+
+    Reader::~Reader() {
+        stop_notifier();
+    }
+
+    RetType Reader::detach() {
+        stop_notifier();
+        return Segment::detach();
+    }
+
+    RetType Reader::attach(vcm::VCM* vcm, int options) {
+        if(FAILURE == Segment::attach(vcm, options)) {
+            return FAILURE;
+        }
+
+        // the first read always gets the current packet, only history written after attaching is new
+        last_nonce = 0;
+        last_history_seq = __atomic_load_n(&(info->history_seq), __ATOMIC_ACQUIRE);
+
+        // the first delta read gets every measurement that has ever been written
+        last_write_seq = 0;
+
+        return SUCCESS;
+    }
+
+    RetType Reader::rebind() {
+        // the notifier thread reads the segment and wake mask, keep it out of the way while they change
+        pause_notifier();
+        RetType ret = rebind_paused();
+        resume_notifier();
+        return ret;
+    }
+
+    RetType Reader::rebind_paused() {
+        if(FAILURE == Segment::rebind()) {
+            return FAILURE;
+        }
+
+        // history from before the layout was published is in the old layout
+        uint64_t start = __atomic_load_n(&(info->layout_history_seq), __ATOMIC_ACQUIRE);
+        if(last_history_seq < start) {
+            last_history_seq = start;
+        }
+
+        // handles changed, so the wake groups did too
+        if(subscribed.size() > 0) {
+            std::vector<std::string> names = subscribed;
+            if(FAILURE == subscribe(names)) {
+                MsgLogger logger("SHM", "Reader::rebind");
+                logger.log_message("Subscribed measurements changed, unsubscribed");
+                unsubscribe();
+            }
+        }
+
+        return SUCCESS;
+    }
+
+    // copy from shmem without locking, retries until the copy wasn't torn by a write
+    // returns the nonce that goes along with the copied data
+    uint32_t Reader::seq_read(void* dst, size_t size, size_t offset) {
+        uint32_t start;
+        uint32_t nonce;
+
+        while(1) {
+            start = __atomic_load_n(&(info->seq), __ATOMIC_ACQUIRE);
+            if(start & 1) { // write in progress
+                sched_yield();
+                continue;
+            }
+
+            memcpy(dst, shmem + offset, size);
+            nonce = __atomic_load_n(&(info->nonce), __ATOMIC_RELAXED);
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&(info->seq), __ATOMIC_RELAXED) == start) {
+                return nonce;
+            }
+        }
+    }
+
+    // enter as a reader in LOCK_MODE
+    // the count only goes up once resource is held, so a dead reader's place in it can be given back
+    RetType Reader::lock() {
+        P_HELD(info->readTry, HELD_READTRY);
+        P_HELD(info->rmutex, HELD_RMUTEX);
+        if(info->readers == 0) {
+            P(info->resource);
+        }
+        info->readers++;
+        hold(HELD_READER);
+        V_HELD(info->rmutex, HELD_RMUTEX);
+        V_HELD(info->readTry, HELD_READTRY);
+
+        return SUCCESS;
+    }
+
+    // leave as a reader in LOCK_MODE
+    RetType Reader::unlock() {
+        P_HELD(info->rmutex, HELD_RMUTEX);
+        unhold(HELD_READER);
+        info->readers--;
+        if(info->readers == 0) {
+            V(info->resource);
+        }
+        V_HELD(info->rmutex, HELD_RMUTEX);
+
+        return SUCCESS;
+    }
+
+    // reading and writing is done with *writers-preference*
+    // https://en.wikipedia.org/wiki/Readers%E2%80%93writers_problem
+    RetType Reader::read(void* dst, size_t size, size_t offset) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::read");
+            logger.log_message("Not attached to shared memory, cannot read");
+            return FAILURE;
+        }
+
+        if((size + offset) < vcm->packet_size) {
+            MsgLogger logger("SHM", "Reader::read");
+            logger.log_message("Shared memory too large to read into destination buffer");
+            return FAILURE;
+        }
+
+        if(info->mode == SEQLOCK_MODE) {
+            uint32_t nonce = seq_read(dst, size, offset);
+            if(stale()) {
+                return stale_failure("Reader::read");
+            }
+            last_nonce = nonce;
+            return SUCCESS;
+        }
+
+        if(FAILURE == lock()) {
+            return FAILURE;
+        }
+
+        bool changed = stale();
+        if(!changed) {
+            memcpy(dst, shmem + offset, size);
+            last_nonce = info->nonce;
+        }
+
+        if(FAILURE == unlock()) {
+            return FAILURE;
+        }
+
+        if(changed) {
+            return stale_failure("Reader::read");
+        }
+
+        return SUCCESS;
+    }
+
+    RetType Reader::read_if_updated(void* dst, size_t size, size_t offset) {
+        RetType ret = SUCCESS;
+
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::read_if_updated");
+            logger.log_message("Not attached to shared memory, cannot read");
+            return FAILURE;
+        }
+
+        if((size + offset) < vcm->packet_size) {
+            MsgLogger logger("SHM", "Reader::read_if_updated");
+            logger.log_message("Shared memory too large to read into destination buffer");
+            return FAILURE;
+        }
+
+        if(info->mode == SEQLOCK_MODE) {
+            if(!changed_since(last_nonce, NULL)) { // no update
+                return FAILURE;
+            }
+            uint32_t nonce = seq_read(dst, size, offset);
+            if(stale()) {
+                return stale_failure("Reader::read_if_updated");
+            }
+            last_nonce = nonce;
+            return SUCCESS;
+        }
+
+        if(FAILURE == lock()) {
+            return FAILURE;
+        }
+
+        bool changed = stale();
+        if(changed || !changed_since(last_nonce, NULL)) { // no update
+            ret = FAILURE;
+        } else { // updated, do the read
+            memcpy(dst, shmem + offset, size);
+            last_nonce = info->nonce;
+        }
+
+        if(FAILURE == unlock()) {
+            return FAILURE;
+        }
+
+        if(changed) {
+            return stale_failure("Reader::read_if_updated");
+        }
+
+        return ret;
+    }
+
+    // TODO check if this causes deadlock
+    RetType Reader::read_block(void* dst, size_t size, size_t offset) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::read_block");
+            logger.log_message("Not attached to shared memory, cannot read");
+            return FAILURE;
+        }
+
+        if((size + offset) < vcm->packet_size) {
+            MsgLogger logger("SHM", "Reader::read_block");
+            logger.log_message("Shared memory too large to read into destination buffer");
+            return FAILURE;
+        }
+
+        if(info->mode == SEQLOCK_MODE) {
+            // only the writer can change the nonce, block until it's different from what we last read
+            uint32_t nonce;
+            while(!changed_since(last_nonce, &nonce)) {
+                sleep(nonce, NULL);
+            }
+            nonce = seq_read(dst, size, offset);
+            if(stale()) {
+                return stale_failure("Reader::read_block");
+            }
+            last_nonce = nonce;
+            return SUCCESS;
+        }
+
+        bool changed = false;
+        int exit = 0;
+        uint32_t nonce;
+        while(!exit) {
+            // enter as a reader
+            if(FAILURE == lock()) {
+                return FAILURE;
+            }
+
+            if(!changed_since(last_nonce, &nonce)) { // block
+                // leave as a reader
+                if(FAILURE == unlock()) {
+                    return FAILURE;
+                }
+
+                // we can guarantee no one changed the nonce so we can block until the nonce changes
+                // only the writer can change the nonce
+                // so block here
+                sleep(nonce, NULL);
+            } else { // do the read
+                changed = stale();
+                if(!changed) {
+                    memcpy(dst, shmem + offset, size);
+                    last_nonce = info->nonce;
+                }
+                exit = 1;
+            }
+        }
+
+        // leave as a reader
+        if(FAILURE == unlock()) {
+            return FAILURE;
+        }
+
+        if(changed) {
+            return stale_failure("Reader::read_block");
+        }
+
+        return SUCCESS;
+    }
+
+    // never takes any locks, each slot in the history ring is protected by its own seqlock
+    RetType Reader::read_history(void* dst, packet_record_t* records, size_t max, size_t* count, size_t* missed) {
+        *count = 0;
+        *missed = 0;
+
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::read_history");
+            logger.log_message("Not attached to shared memory, cannot read history");
+            return FAILURE;
+        }
+
+        if(info->history_slots == 0) {
+            MsgLogger logger("SHM", "Reader::read_history");
+            logger.log_message("Shared memory has no history ring");
+            return FAILURE;
+        }
+
+        if(stale()) {
+            return stale_failure("Reader::read_history");
+        }
+
+        // packets are added to the history before the nonce is updated, so everything
+        // written up to this nonce is in the history
+        uint32_t nonce = __atomic_load_n(&(info->nonce), __ATOMIC_ACQUIRE);
+        uint64_t first = last_history_seq;
+
+        uint64_t head = __atomic_load_n(&(info->history_seq), __ATOMIC_ACQUIRE);
+        if(head == last_history_seq) { // nothing new
+            last_nonce = nonce;
+            return FAILURE;
+        }
+
+        // skip anything that's already been overwritten
+        uint64_t seq = last_history_seq + 1;
+        if(head - last_history_seq > info->history_slots) {
+            seq = head - info->history_slots + 1;
+            *missed += seq - (last_history_seq + 1);
+        }
+
+        unsigned char* out = (unsigned char*)dst;
+        for(; seq <= head && *count < max; seq++) {
+            slot_header_t* slot = history_slot(info, shmem, seq);
+
+            while(1) {
+                uint32_t lock = __atomic_load_n(&(slot->lock), __ATOMIC_ACQUIRE);
+                if(lock & 1) { // write in progress
+                    sched_yield();
+                    continue;
+                }
+
+                uint64_t slot_seq = slot->seq;
+                uint64_t timestamp = slot->timestamp;
+                memcpy(out, (unsigned char*)slot + sizeof(slot_header_t), vcm->packet_size);
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if(__atomic_load_n(&(slot->lock), __ATOMIC_RELAXED) != lock) { // torn, try again
+                    continue;
+                }
+
+                if(slot_seq != seq) { // the writer lapped us
+                    (*missed)++;
+                } else {
+                    records[*count].seq = seq;
+                    records[*count].timestamp = timestamp;
+                    out += vcm->packet_size;
+                    (*count)++;
+                }
+                break;
+            }
+
+            last_history_seq = seq;
+        }
+
+        // packets from a layout published while reading can't be told apart, so read them again after rebinding
+        if(stale()) {
+            last_history_seq = first;
+            *count = 0;
+            *missed = 0;
+            return stale_failure("Reader::read_history");
+        }
+
+        // caught up, so there's no update left to wait for
+        if(seq > head) {
+            last_nonce = nonce;
+        }
+
+        if(*count == 0) {
+            return FAILURE;
+        }
+
+        return SUCCESS;
+    }
+
+    RetType Reader::read_history_block(void* dst, packet_record_t* records, size_t max, size_t* count, size_t* missed) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::read_history_block");
+            logger.log_message("Not attached to shared memory, cannot read history");
+            return FAILURE;
+        }
+
+        if(info->history_slots == 0) {
+            MsgLogger logger("SHM", "Reader::read_history_block");
+            logger.log_message("Shared memory has no history ring");
+            return FAILURE;
+        }
+
+        size_t lost = 0;
+        uint32_t nonce;
+        while(1) {
+            if(SUCCESS == read_history(dst, records, max, count, missed)) {
+                *missed += lost;
+                return SUCCESS;
+            }
+            if(stale()) { // read_history already logged why
+                return FAILURE;
+            }
+            lost += *missed; // everything new was overwritten, keep count and wait for more
+
+            // every packet added to the history also bumps the nonce, so block on that
+            if(!changed_since(last_nonce, &nonce)) {
+                sleep(nonce, NULL);
+            }
+        }
+    }
+
+
+    // copy every measurement written since the last delta read
+    // must be called while holding the reader lock or inside a seqlock read
+    void Reader::copy_changed(unsigned char* dst, std::vector<vcm::handle_t>& changed, uint64_t* write_seq) {
+        *write_seq = __atomic_load_n(&(info->write_seq), __ATOMIC_ACQUIRE);
+
+        changed.clear();
+        for(vcm::handle_t i = 0; i < vcm->measurements.size(); i++) {
+            if(meas_seq[i] > last_write_seq) {
+                vcm::measurement_info_t* m_info = vcm->get_info(i);
+                size_t addr = (size_t)m_info->addr;
+                memcpy(dst + addr, shmem + addr, m_info->size);
+                changed.push_back(i);
+            }
+        }
+    }
+
+    // locking works the same as read
+    RetType Reader::read_delta(void* dst, size_t size, std::vector<vcm::handle_t>& changed) {
+        changed.clear();
+
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::read_delta");
+            logger.log_message("Not attached to shared memory, cannot read");
+            return FAILURE;
+        }
+
+        if(size < vcm->packet_size) {
+            MsgLogger logger("SHM", "Reader::read_delta");
+            logger.log_message("Shared memory too large to read into destination buffer");
+            return FAILURE;
+        }
+
+        uint64_t write_seq;
+
+        if(info->mode == SEQLOCK_MODE) {
+            while(1) {
+                uint32_t start = __atomic_load_n(&(info->seq), __ATOMIC_ACQUIRE);
+                if(start & 1) { // write in progress
+                    sched_yield();
+                    continue;
+                }
+
+                copy_changed((unsigned char*)dst, changed, &write_seq);
+                uint32_t nonce = __atomic_load_n(&(info->nonce), __ATOMIC_RELAXED);
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if(__atomic_load_n(&(info->seq), __ATOMIC_RELAXED) == start) {
+                    if(stale()) {
+                        changed.clear();
+                        return stale_failure("Reader::read_delta");
+                    }
+                    last_nonce = nonce;
+                    break;
+                }
+            }
+        } else {
+            if(FAILURE == lock()) {
+                return FAILURE;
+            }
+
+            bool layout = stale();
+            if(!layout) {
+                copy_changed((unsigned char*)dst, changed, &write_seq);
+                last_nonce = info->nonce;
+            }
+
+            if(FAILURE == unlock()) {
+                return FAILURE;
+            }
+
+            if(layout) {
+                return stale_failure("Reader::read_delta");
+            }
+        }
+
+        last_write_seq = write_seq;
+
+        if(changed.size() == 0) {
+            return FAILURE;
+        }
+
+        return SUCCESS;
+    }
+
+    RetType Reader::read_delta_block(void* dst, size_t size, std::vector<vcm::handle_t>& changed) {
+        while(1) {
+            if(FAILURE == wait()) {
+                return FAILURE;
+            }
+
+            if(SUCCESS == read_delta(dst, size, changed)) {
+                return SUCCESS;
+            }
+
+            if(!attached || size < vcm->packet_size || stale()) { // read_delta already logged why
+                return FAILURE;
+            }
+            // the write didn't touch any measurements, wait for another one
+        }
+    }
+
+    // true if there's been a write to a subscribed group since 'since'
+    // nonce is set to the current nonce, to sleep on if nothing changed
+    bool Reader::changed_since(uint32_t since, uint32_t* nonce) {
+        uint32_t curr = __atomic_load_n(&(info->nonce), __ATOMIC_ACQUIRE);
+        if(nonce) {
+            *nonce = curr;
+        }
+
+        if(curr == since) {
+            return false;
+        }
+
+        // changed by subscribe while the notifier thread (see get_fd) is reading it
+        uint32_t mask = __atomic_load_n(&wake_mask, __ATOMIC_RELAXED);
+        if(mask == FUTEX_BITSET_MATCH_ANY) { // not subscribed, every write counts
+            return true;
+        }
+
+        // a group was written after 'since' if it was written more recently, the nonce wraps
+        // around so compare how long ago each was instead of the nonces themselves
+        for(size_t g = 0; g < WAKE_GROUPS; g++) {
+            if(mask & (1u << g)) {
+                uint32_t written = __atomic_load_n(&(info->group_nonce[g]), __ATOMIC_RELAXED);
+                if((uint32_t)(curr - written) < (uint32_t)(curr - since)) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    // sleep until a write to a subscribed group or 'deadline' (CLOCK_MONOTONIC), NULL waits forever
+    // returns right away if the nonce isn't 'nonce' anymore
+    // returns false if the deadline passed
+    bool Reader::sleep(uint32_t nonce, struct timespec* deadline) {
+        uint32_t mask = __atomic_load_n(&wake_mask, __ATOMIC_RELAXED);
+        if(-1 == syscall(SYS_futex, &(info->nonce), FUTEX_WAIT_BITSET, nonce, deadline, NULL, mask)) {
+            return errno != ETIMEDOUT;
+        }
+        return true;
+    }
+
+    RetType Reader::subscribe(std::vector<std::string>& names) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::subscribe");
+            logger.log_message("Not attached to shared memory, cannot subscribe");
+            return FAILURE;
+        }
+
+        uint32_t mask = 0;
+        for(std::string& name : names) {
+            vcm::handle_t i = vcm->get_handle(name);
+            if(i == vcm::INVALID_HANDLE) {
+                MsgLogger logger("SHM", "Reader::subscribe");
+                logger.log_message("No measurement named " + name);
+                return FAILURE;
+            }
+
+            mask |= wake_group(i);
+        }
+
+        if(mask == 0) {
+            MsgLogger logger("SHM", "Reader::subscribe");
+            logger.log_message("No measurements to subscribe to");
+            return FAILURE;
+        }
+
+        __atomic_store_n(&wake_mask, mask, __ATOMIC_RELAXED);
+        subscribed = names;
+        return SUCCESS;
+    }
+
+    void Reader::unsubscribe() {
+        __atomic_store_n(&wake_mask, FUTEX_BITSET_MATCH_ANY, __ATOMIC_RELAXED);
+        subscribed.clear();
+    }
+
+    bool Reader::updated() {
+        if(!attached) {
+            return false;
+        }
+
+        return changed_since(last_nonce, NULL);
+    }
+
+    RetType Reader::wait(int timeout) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::wait");
+            logger.log_message("Not attached to shared memory, cannot wait");
+            return FAILURE;
+        }
+
+        struct timespec deadline;
+        if(timeout >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += timeout / 1000;
+            deadline.tv_nsec += (timeout % 1000) * 1000000;
+            if(deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+        }
+
+        uint32_t nonce;
+        while(!changed_since(last_nonce, &nonce)) {
+            if(!sleep(nonce, timeout >= 0 ? &deadline : NULL)) { // timed out
+                return updated() ? SUCCESS : FAILURE;
+            }
+        }
+
+        return SUCCESS;
+    }
+
+    // runs in its own thread, signals the eventfd every time a subscribed group is written
+    void Reader::notify(uint32_t nonce) {
+        struct timespec deadline;
+
+        uint64_t one = 1;
+        uint32_t curr;
+        while(__atomic_load_n(&notifying, __ATOMIC_ACQUIRE)) {
+            if(changed_since(nonce, &curr)) {
+                nonce = curr;
+                if(write(notify_fd, &one, sizeof(one)) != sizeof(one)) {
+                    // counter is full, the fd is already readable
+                }
+                continue;
+            }
+
+            // wake up every so often to check if we should stop
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += NOTIFY_POLL_INTERVAL;
+            if(deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            sleep(curr, &deadline);
+        }
+    }
+
+    int Reader::get_fd() {
+        if(notify_fd != -1) {
+            return notify_fd;
+        }
+
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::get_fd");
+            logger.log_message("Not attached to shared memory, cannot create file descriptor");
+            return -1;
+        }
+
+        notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(notify_fd == -1) {
+            MsgLogger logger("SHM", "Reader::get_fd");
+            logger.log_message("eventfd failure");
+            return -1;
+        }
+
+        resume_notifier();
+
+        return notify_fd;
+    }
+
+    // start the notifier thread if there's an eventfd for it
+    void Reader::resume_notifier() {
+        if(notify_fd == -1 || notifier.joinable()) {
+            return;
+        }
+
+        // start from what this reader has read, so an unread write makes the fd readable right away
+        notifying = true;
+        notifier = std::thread(&Reader::notify, this, last_nonce);
+    }
+
+    // stop the notifier thread, leaving the eventfd open
+    void Reader::pause_notifier() {
+        if(!notifier.joinable()) {
+            return;
+        }
+
+        __atomic_store_n(&notifying, false, __ATOMIC_RELEASE);
+
+        // wake it up if it's waiting on a write, rather than waiting for it to check on its own
+        syscall(SYS_futex, &(info->nonce), FUTEX_WAKE_BITSET, INT_MAX, NULL, NULL, FUTEX_BITSET_MATCH_ANY);
+        notifier.join();
+    }
+
+    void Reader::stop_notifier() {
+        if(notify_fd == -1) {
+            return;
+        }
+
+        pause_notifier();
+
+        close(notify_fd);
+        notify_fd = -1;
+    }
+
+    RetType wait_any(std::vector<Reader*>& readers, size_t* index) {
+        if(readers.size() == 0 || readers.size() > MAX_WAIT_READERS) {
+            MsgLogger logger("SHM", "wait_any");
+            logger.log_message("Invalid number of readers to wait on");
+            return FAILURE;
+        }
+
+        for(Reader* reader : readers) {
+            if(!reader->attached) {
+                MsgLogger logger("SHM", "wait_any");
+                logger.log_message("Not attached to shared memory, cannot wait");
+                return FAILURE;
+            }
+        }
+
+#if defined(SYS_futex_waitv) && defined(FUTEX_32)
+        struct futex_waitv waiters[MAX_WAIT_READERS];
+        bool use_waitv = true;
+#else
+        bool use_waitv = false;
+#endif
+
+        uint32_t nonces[MAX_WAIT_READERS];
+        struct pollfd fds[MAX_WAIT_READERS];
+        bool use_poll = false;
+
+        while(1) {
+            // clear the eventfds before checking, a write after this makes them readable again
+            if(use_poll) {
+                uint64_t count;
+                for(size_t i = 0; i < readers.size(); i++) {
+                    if(read(fds[i].fd, &count, sizeof(count)) != sizeof(count)) {
+                        // nothing written since it was last cleared
+                    }
+                }
+            }
+
+            for(size_t i = 0; i < readers.size(); i++) {
+                if(readers[i]->changed_since(readers[i]->last_nonce, &(nonces[i]))) {
+                    *index = i;
+                    return SUCCESS;
+                }
+            }
+
+#if defined(SYS_futex_waitv) && defined(FUTEX_32)
+            // futex_waitv sleeps on all of the nonces at once (Linux 5.16+)
+            // it can't filter by wake group, so subscribed readers are woken by every write
+            if(use_waitv) {
+                for(size_t i = 0; i < readers.size(); i++) {
+                    waiters[i].val = nonces[i];
+                    waiters[i].uaddr = (uintptr_t)&(readers[i]->info->nonce);
+                    waiters[i].flags = FUTEX_32; // shared, not private
+                    waiters[i].__reserved = 0;
+                }
+
+                if(-1 != syscall(SYS_futex_waitv, waiters, readers.size(), 0, NULL, CLOCK_MONOTONIC) ||
+                   errno != ENOSYS) {
+                    // woken, a nonce already changed (EAGAIN), or interrupted, check again
+                    continue;
+                }
+
+                use_waitv = false;
+            }
+#endif
+
+            // otherwise every reader's notifier thread (see Reader::get_fd) watches its nonce, and
+            // sleep until any of their eventfds is readable
+            if(!use_waitv && !use_poll) {
+                use_poll = true;
+                for(size_t i = 0; i < readers.size() && use_poll; i++) {
+                    fds[i].fd = readers[i]->get_fd();
+                    fds[i].events = POLLIN;
+                    use_poll = (fds[i].fd != -1);
+                }
+
+                if(use_poll) {
+                    continue; // a write could have come in before the notifiers started
+                }
+            }
+
+            if(use_poll) {
+                poll(fds, readers.size(), -1); // woken, or interrupted, check again
+                continue;
+            }
+
+            // only if there aren't any file descriptors left, sleep on the first nonce for a bit
+            struct timespec timeout;
+            timeout.tv_sec = 0;
+            timeout.tv_nsec = WAIT_ANY_POLL_INTERVAL;
+            syscall(SYS_futex, &(readers[0]->info->nonce), FUTEX_WAIT, nonces[0], &timeout, NULL, 0);
+        }
+    }
+
+    View::View(): data(NULL), vcm(NULL), seq(0), last_nonce(0) {}
+
+    // locking works the same as read, but the reader lock is held until end_view
+    RetType Reader::open_view(View* view) {
+        view->vcm = vcm;
+        view->data = shmem;
+        view->last_nonce = last_nonce;
+
+        if(info->mode == SEQLOCK_MODE) {
+            // wait for any write in progress to finish
+            while((view->seq = __atomic_load_n(&(info->seq), __ATOMIC_ACQUIRE)) & 1) {
+                sched_yield();
+            }
+
+            // publishing a layout bumps the seqlock, so end_view catches a layout published after this
+            if(stale()) {
+                view->data = NULL;
+                return stale_failure("Reader::begin_view");
+            }
+
+            last_nonce = __atomic_load_n(&(info->nonce), __ATOMIC_RELAXED);
+            return SUCCESS;
+        }
+
+        if(FAILURE == lock()) {
+            return FAILURE;
+        }
+
+        if(stale()) {
+            view->data = NULL;
+
+            // leave as a reader, the view won't be closed
+            if(FAILURE == unlock()) {
+                return FAILURE;
+            }
+
+            return stale_failure("Reader::begin_view");
+        }
+
+        last_nonce = info->nonce;
+
+        return SUCCESS;
+    }
+
+    RetType Reader::begin_view(View* view) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::begin_view");
+            logger.log_message("Not attached to shared memory, cannot open view");
+            return FAILURE;
+        }
+
+        return open_view(view);
+    }
+
+    RetType Reader::begin_view_if_updated(View* view) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::begin_view_if_updated");
+            logger.log_message("Not attached to shared memory, cannot open view");
+            return FAILURE;
+        }
+
+        // only the writer can change the nonce, so this is safe to check without locking
+        // if the nonce changes right after, the view will just be of a newer packet
+        if(!changed_since(last_nonce, NULL)) { // no update
+            return FAILURE;
+        }
+
+        return open_view(view);
+    }
+
+    RetType Reader::begin_view_block(View* view) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::begin_view_block");
+            logger.log_message("Not attached to shared memory, cannot open view");
+            return FAILURE;
+        }
+
+        uint32_t nonce;
+        while(!changed_since(last_nonce, &nonce)) {
+            sleep(nonce, NULL);
+        }
+
+        return open_view(view);
+    }
+
+    RetType Reader::end_view(View* view) {
+        if(!attached) {
+            MsgLogger logger("SHM", "Reader::end_view");
+            logger.log_message("Not attached to shared memory, cannot close view");
+            return FAILURE;
+        }
+
+        view->data = NULL;
+
+        if(info->mode == SEQLOCK_MODE) {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&(info->seq), __ATOMIC_RELAXED) != view->seq) {
+                // torn, so this packet hasn't really been read yet
+                last_nonce = view->last_nonce;
+                return FAILURE;
+            }
+            return SUCCESS;
+        }
+
+        // leave as a reader
+        if(FAILURE == unlock()) {
+            return FAILURE;
+        }
+
+        return SUCCESS;
+    }
+
+
+    // set up a new info block
+    RetType init_info(shm_info_t* info, vcm::VCM* vcm, shm_mode_t mode, size_t history_slots, int options,
+                      size_t reserve) {
+        // init semaphores
+        INIT(info->rmutex, 1);
+        INIT(info->wmutex, 1);
+        INIT(info->readTry, 1);
+        INIT(info->resource, 1);
+
+        // init reader/writer counts to 0
+        info->readers = 0;
+        info->writers = 0;
+
+        // start the nonce at 0
+        info->nonce = 0;
+
+        // start with no write in progress
+        info->seq = 0;
+        info->mode = mode;
+
+        // history ring starts empty, first packet written is sequence number 1
+        info->history_slots = history_slots;
+        info->history_seq = 0;
+
+        // no measurement has been written yet
+        info->write_seq = 0;
+        memset(info->group_nonce, 0, sizeof(info->group_nonce));
+
+        // no one is attached yet
+        memset(info->holders, 0, sizeof(info->holders));
+
+        memset(info->device, 0, sizeof(info->device));
+        strncpy(info->device, vcm->device.c_str(), MAX_DEVICE_NAME - 1);
+
+        // backend options aren't needed after attaching
+        info->options = options & (SHM_OPT_HUGEPAGES | SHM_OPT_POPULATE | SHM_OPT_MLOCK);
+
+        // the first layout, there's room for at least one measurement per byte set aside
+        info->generation = 0;
+        info->layout_hash = vcm->layout_hash();
+        info->layout_history_seq = 0;
+        info->packet_capacity = vcm->packet_size + reserve;
+        info->meas_capacity = vcm->measurements.size();
+        if(info->meas_capacity < info->packet_capacity) {
+            info->meas_capacity = info->packet_capacity;
+        }
+
+        return SUCCESS;
+    }
+
+    RetType create_sysv(vcm::VCM* vcm, shm_mode_t mode, size_t history_slots, int options, size_t reserve) {
+        MsgLogger logger("SHM", "create_sysv");
+
+        // create info shmem
+        key_t info_key = sysv_key(vcm, info_id);
+
+        int info_shmid = shmget(info_key, sizeof(shm_info_t),
+                                0666|IPC_CREAT|IPC_EXCL);
+        if(info_shmid == -1) {
+            // already created, for this device or another one with the same key
+            int existing = (errno == EEXIST) ? shmget(info_key, 0, 0) : -1;
+            shm_info_t* other = (existing == -1) ? (shm_info_t*)-1 : (shm_info_t*)shmat(existing, NULL, SHM_RDONLY);
+            if(other != (void*)-1) {
+                if(!same_device(other, vcm)) {
+                    logger.log_message("System V key is already used by shared memory for device " +
+                                       device_of(other) + ", rename one of them");
+                } else {
+                    logger.log_message("Shared memory already created");
+                }
+                shmdt(other);
+                return FAILURE;
+            }
+
+            logger.log_message("shmget failure for info shmem");
+            return FAILURE;
+        }
+
+        // briefly attach to info shmem
+        shm_info_t* info = (shm_info_t*) shmat(info_shmid, (void*)0, 0);
+        if(info == (void*) -1) {
+            logger.log_message("shmat failure, cannot attach to info shmem");
+            return FAILURE;
+        }
+
+        if(FAILURE == init_info(info, vcm, mode, history_slots, options, reserve)) {
+            logger.log_message("failed to initialize info shmem");
+            return FAILURE;
+        }
+        size_t size = block_size(info);
+
+        // detach from info shmem
+        if(shmdt(info) != 0) {
+            logger.log_message("shmdt failure, failed to detach from info shmem");
+            return FAILURE;
+        }
+
+        // set up shmem
+        key_t key = sysv_key(vcm, id);
+
+        int flags = 0666|IPC_CREAT|IPC_EXCL;
+        if(options & SHM_OPT_HUGEPAGES) {
+            flags |= SHM_HUGETLB;
+        }
+
+        int shmid = shmget(key, size, flags);
+        if(shmid == -1) {
+            logger.log_message("shmget failure");
+            shmctl(info_shmid, IPC_RMID, NULL); // don't leave half created shared memory around
+            return FAILURE;
+        }
+
+        return SUCCESS;
+    }
+
+    RetType create_posix(vcm::VCM* vcm, shm_mode_t mode, size_t history_slots, int options, size_t reserve) {
+        MsgLogger logger("SHM", "create_posix");
+
+        // create info shmem
+        int fd = shm_open(posix_info_name(vcm).c_str(), O_RDWR|O_CREAT|O_EXCL, 0666);
+        if(fd == -1) {
+            logger.log_message("shm_open failure for info shmem");
+            return FAILURE;
+        }
+
+        // match System V permissions regardless of umask
+        if(fchmod(fd, 0666) != 0 || ftruncate(fd, sizeof(shm_info_t)) != 0) {
+            close(fd);
+            logger.log_message("failed to size info shmem");
+            return FAILURE;
+        }
+
+        size_t info_size;
+        shm_info_t* info = (shm_info_t*) map_posix(fd, &info_size, 0);
+        close(fd);
+        if(!info) {
+            logger.log_message("mmap failure, cannot attach to info shmem");
+            return FAILURE;
+        }
+
+        if(FAILURE == init_info(info, vcm, mode, history_slots, options, reserve)) {
+            logger.log_message("failed to initialize info shmem");
+            return FAILURE;
+        }
+        size_t size = block_size(info);
+
+        munmap(info, info_size);
+
+        // set up shmem
+        if(options & SHM_OPT_HUGEPAGES) {
+            fd = open(hugepage_path(vcm).c_str(), O_RDWR|O_CREAT|O_EXCL, 0666);
+            size = (size + HUGEPAGE_SIZE - 1) & ~((size_t)HUGEPAGE_SIZE - 1); // must be a whole number of huge pages
+        } else {
+            fd = shm_open(posix_name(vcm).c_str(), O_RDWR|O_CREAT|O_EXCL, 0666);
+        }
+
+        if(fd == -1) {
+            logger.log_message("shm_open failure");
+            shm_unlink(posix_info_name(vcm).c_str()); // don't leave half created shared memory around
+            return FAILURE;
+        }
+
+        if(fchmod(fd, 0666) != 0 || ftruncate(fd, size) != 0) {
+            close(fd);
+            logger.log_message("failed to size shmem");
+            if(options & SHM_OPT_HUGEPAGES) {
+                unlink(hugepage_path(vcm).c_str());
+            } else {
+                shm_unlink(posix_name(vcm).c_str());
+            }
+            shm_unlink(posix_info_name(vcm).c_str());
+            return FAILURE;
+        }
+
+        close(fd);
+        return SUCCESS;
+    }
+
+    RetType create_shm(vcm::VCM* vcm, shm_mode_t mode, size_t history_slots, int options, size_t reserve) {
+        if(options & SHM_OPT_POSIX) {
+            return create_posix(vcm, mode, history_slots, options, reserve);
+        }
+
+        return create_sysv(vcm, mode, history_slots, options, reserve);
+    }
+
+
+    // process-wide reader and writer used by the functions below
+    Reader reader;
+    Writer writer;
+
+    size_t get_shmem_size() {
+        return reader.get_size();
+    }
+
+    size_t get_history_slots() {
+        return reader.get_history_slots();
+    }
+
+    RetType attach_to_shm(vcm::VCM* vcm, int options) {
+        if(FAILURE == reader.attach(vcm, options)) {
+            return FAILURE;
+        }
+
+        if(FAILURE == writer.attach(vcm, options)) {
+            reader.detach();
+            return FAILURE;
+        }
+
+        return SUCCESS;
+    }
+
+    RetType detach_from_shm() {
+        RetType ret = SUCCESS;
+
+        if(FAILURE == writer.detach()) {
+            ret = FAILURE;
+        }
+
+        if(FAILURE == reader.detach()) {
+            ret = FAILURE;
+        }
+
+        return ret;
+    }
+
+    RetType destroy_shm() {
+        return reader.destroy();
+    }
+
+    RetType write_to_shm(void* src, size_t size, size_t offset) {
+        return writer.write(src, size, offset);
+    }
+
+    RetType write_packet_to_shm(const unsigned char* packet, vcm::packet_type_t* type, bool derived) {
+        return writer.write_packet(packet, type, derived);
+    }
+
+    RetType read_from_shm(void* dst, size_t size, size_t offset) {
+        return reader.read(dst, size, offset);
+    }
+
+    RetType read_from_shm_if_updated(void* dst, size_t size, size_t offset) {
+        return reader.read_if_updated(dst, size, offset);
+    }
+
+    RetType read_from_shm_block(void* dst, size_t size, size_t offset) {
+        return reader.read_block(dst, size, offset);
+    }
+
+    RetType read_history(void* dst, packet_record_t* records, size_t max, size_t* count, size_t* missed) {
+        return reader.read_history(dst, records, max, count, missed);
+    }
+
+    RetType read_history_block(void* dst, packet_record_t* records, size_t max, size_t* count, size_t* missed) {
+        return reader.read_history_block(dst, records, max, count, missed);
+    }
+
+    RetType clear_shm() {
+        return writer.clear();
+    }
+
+    RetType recover_shm(bool* recovered) {
+        return reader.recover(recovered);
+    }
+
+    bool layout_changed() {
+        return reader.layout_changed() || writer.layout_changed();
+    }
+
+    uint32_t get_generation() {
+        return reader.get_generation();
+    }
+
+    // the reader and writer share a VCM, the first to rebind reloads it for both
+    RetType rebind_shm() {
+        RetType ret = SUCCESS;
+
+        if(reader.attached && FAILURE == reader.rebind()) {
+            ret = FAILURE;
+        }
+
+        if(writer.attached && FAILURE == writer.rebind()) {
+            ret = FAILURE;
         }
 
         return ret;
@@ -458,4 +2399,12 @@ namespace shm {
 
 #undef P
 #undef V
+#undef P_HELD
+#undef V_HELD
 #undef INIT
+#undef WAIT_ANY_POLL_INTERVAL
+#undef RECOVER_TIMEOUT
+#undef MAX_COVERAGE
+#undef NOTIFY_POLL_INTERVAL
+#undef HUGEPAGE_DIR
+#undef HUGEPAGE_SIZE
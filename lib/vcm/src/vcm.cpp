@@ -6,29 +6,141 @@
 #include <sstream>
 #include <exception>
 #include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <algorithm>
 #include "endian.h"
 
 using namespace dls;
 using namespace vcm;
 
-VCM::VCM() {
-    MsgLogger logger("VCM", "Constructor");
+// compiled layout cache files
+// they're only meant for the machine that wrote them, everything is in native byte order
+#define CACHE_MAGIC 0x434d4356 // "VCMC"
+#define CACHE_VERSION 5 // bump whenever the layout of the cache changes
+
+// widest measurement that can be sized in bits, so it always fits in 8 bytes wherever it starts
+#define MAX_PACKED_BITS 57
+
+// most displacements tried for one hash bucket before giving up on building the hash table
+#define MAX_HASH_SEED 1000000
+
+// start of a cache file, followed by
+// [measurement_info_t for every measurement][uint64_t name offset for every measurement]
+// [packet_type_t for every packet type][derive_op_t for every derived measurement instruction]
+// [uint32_t seed for every hash bucket][uint32_t handle for every hash slot]
+// [null terminated device name and measurement names]
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t checksum; // FNV-1a of everything after the header
+    uint64_t size; // bytes, whole file
+    uint64_t info_size; // sizeof(measurement_info_t) when the cache was written
+
+    // config file the cache was compiled from, the cache is out of date if any of these change
+    uint64_t source_dev;
+    uint64_t source_ino;
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+
+    int32_t addr;
+    int32_t port;
+    uint32_t protocol; // protocol_t
+    uint32_t recv_endianness; // endianness_t
+    uint32_t shm_endianness; // endianness_t
+    uint32_t reserved;
+    uint64_t packet_size;
+    uint32_t device; // offset of the device name from the start of the file
+    uint32_t num_measurements;
+    uint32_t hash_buckets; // power of 2
+    uint32_t hash_slots; // power of 2
+    uint64_t header_size;
+    uint32_t id_handle;
+    uint32_t num_packet_types;
+    uint64_t recv_size;
+    uint64_t derived_addr;
+    uint32_t num_derived;
+    uint32_t num_derive_ops;
+} cache_header_t;
+
+// https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325
+
+// 'hash' continues a previous hash, so several pieces can be hashed as one
+static uint64_t fnv1a(const unsigned char* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS) {
+    for(size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
 
-    // default values
+// measurement names are looked up with a perfect hash built when the config file is parsed
+// https://en.wikipedia.org/wiki/Perfect_hash_function (hash and displace)
+// the name's hash picks a bucket, and the bucket's seed picks a slot no other name uses
+static inline uint32_t hash_slot(uint64_t hash, uint32_t seed, uint32_t slots) {
+    // splitmix64 finalizer, so every seed scatters the names differently
+    uint64_t x = hash ^ (seed * 0x9e3779b97f4a7c15);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    x ^= x >> 31;
+    return x & (slots - 1);
+}
+
+static inline uint32_t next_pow2(uint32_t n) {
+    uint32_t p = 1;
+    while(p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+// true if the cache was compiled from the config file as it is now
+static bool cache_matches(cache_header_t* header, struct stat* st) {
+    return header->source_dev == (uint64_t)st->st_dev &&
+           header->source_ino == (uint64_t)st->st_ino &&
+           header->source_size == (uint64_t)st->st_size &&
+           header->source_mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+           header->source_mtime_nsec == (int64_t)st->st_mtim.tv_nsec;
+}
+
+// everything a config file doesn't set stays at these
+void VCM::set_defaults() {
     addr = port = -1;
     protocol = PROTOCOL_NOT_SET;
     packet_size = 0;
     device = "";
     recv_endianness = GSW_LITTLE_ENDIAN; // default is little endian
+    sys_endianness = (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__) ? GSW_BIG_ENDIAN : GSW_LITTLE_ENDIAN;
+    shm_endianness = recv_endianness;
+    f = NULL;
+    image = NULL;
+    image_size = 0;
+    mapped = false;
+    table = NULL;
+    num_packet_types = 0;
+    header_size = 0;
+    id_handle = INVALID_HANDLE;
+    recv_size = 0;
+    num_derived = 0;
+    derived_addr = 0;
+    derive_ops = NULL;
+    num_derive_ops = 0;
+}
 
-    if(__BYTE_ORDER == __BIG_ENDIAN) {
-        sys_endianness = GSW_BIG_ENDIAN;
-    } else if(__BYTE_ORDER == __LITTLE_ENDIAN) {
-        sys_endianness = GSW_LITTLE_ENDIAN;
-    } else {
-        logger.log_message("Could not determine endianness of system, assuming little endian");
-        sys_endianness = GSW_LITTLE_ENDIAN;
-    }
+VCM::VCM() {
+    MsgLogger logger("VCM", "Constructor");
+
+    set_defaults();
 
     // figure out default config file
     char* env = getenv("GSW_HOME");
@@ -49,12 +161,7 @@ VCM::VCM() {
 VCM::VCM(std::string config_file) {
     this->config_file = config_file;
 
-    // default values
-    addr = port = -1;
-    protocol = PROTOCOL_NOT_SET;
-    packet_size = 0;
-    // compressed_size = 0;
-    device = "";
+    set_defaults();
 
     // init
     if(init() != SUCCESS) {
@@ -63,9 +170,13 @@ VCM::VCM(std::string config_file) {
 }
 
 VCM::~VCM() {
-    // free all pointers in addr_map
-    for(auto i : addr_map) {
-        delete i.second;
+    // all measurement info is in the image
+    if(image) {
+        if(mapped) {
+            munmap(image, image_size);
+        } else {
+            delete[] image;
+        }
     }
 
     if(f) {
@@ -77,16 +188,513 @@ VCM::~VCM() {
     }
 }
 
-measurement_info_t* VCM::get_info(std::string measurement) {
-    if(addr_map.count(measurement)) {
-        return addr_map.at(measurement);
-    } else {
+RetType VCM::reload() {
+    if(image) {
+        if(mapped) {
+            munmap(image, image_size);
+        } else {
+            delete[] image;
+        }
+    }
+
+    if(f) {
+        if(f->is_open()) {
+            f->close();
+        }
+
+        delete f;
+    }
+
+    // back to the default values, anything the config file doesn't set stays at its default
+    set_defaults();
+    measurements.clear();
+
+    return init();
+}
+
+measurement_info_t* VCM::get_info(const std::string& measurement) {
+    handle_t handle = get_handle(measurement);
+    if(handle == INVALID_HANDLE) {
         return NULL;
     }
+    return &(table[handle]);
+}
+
+handle_t VCM::get_handle(const std::string& measurement) {
+    if(measurements.size() == 0) {
+        return INVALID_HANDLE;
+    }
+
+    uint64_t hash = fnv1a((const unsigned char*)measurement.c_str(), measurement.size());
+    uint32_t seed = hash_seeds[hash & (num_hash_buckets - 1)];
+    uint32_t handle = hash_handles[hash_slot(hash, seed, num_hash_slots)];
+
+    // every name hashes to a slot, make sure it's actually this one
+    if(handle == INVALID_HANDLE || strcmp(measurement.c_str(), (const char*)(image + names[handle])) != 0) {
+        return INVALID_HANDLE;
+    }
+
+    return handle;
+}
+
+packet_type_t* VCM::get_packet_type(const void* packet, size_t size) {
+    if(num_packet_types == 0 || size < header_size) {
+        return NULL;
+    }
+
+    // put the id's bytes together in the receiver's endianness, then take off the padding
+    measurement_info_t* info = &(table[id_handle]);
+    const unsigned char* buff = (const unsigned char*)packet + (size_t)info->addr;
+    uint64_t raw = 0;
+    for(size_t i = 0; i < info->size; i++) {
+        if(recv_endianness == GSW_BIG_ENDIAN) {
+            raw = (raw << 8) | buff[i];
+        } else {
+            raw |= (uint64_t)buff[i] << (8 * i);
+        }
+    }
+
+    size_t bits = info->size * 8 - info->l_padding - info->r_padding;
+    raw >>= info->r_padding;
+    if(bits < 64) {
+        raw &= ((uint64_t)1 << bits) - 1;
+    }
+
+    // only a few types, so look through them
+    for(size_t i = 0; i < num_packet_types; i++) {
+        if(packet_types[i].id == raw) {
+            if(size != header_size + packet_types[i].size) {
+                return NULL;
+            }
+            return &(packet_types[i]);
+        }
+    }
+
+    return NULL;
+}
+
+RetType VCM::unpack(unsigned char* dst, const void* packet, size_t size, packet_type_t** type) {
+    packet_type_t* found = NULL;
+    if(type) {
+        *type = NULL;
+    }
+
+    if(num_packet_types == 0) {
+        if(size != recv_size) {
+            return FAILURE;
+        }
+        memcpy(dst, packet, size);
+        return SUCCESS;
+    }
+
+    found = get_packet_type(packet, size);
+    if(!found) {
+        return FAILURE;
+    }
+    if(type) {
+        *type = found;
+    }
+
+    memcpy(dst, packet, header_size);
+    memcpy(dst + found->addr, (const unsigned char*)packet + header_size, found->size);
+    return SUCCESS;
+}
+
+uint64_t VCM::layout_hash() {
+    // fixed width fields so the hash doesn't depend on how the compiler lays out structs
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint64_t val = packet_size;
+    hash = fnv1a((const unsigned char*)&val, sizeof(val), hash);
+    val = recv_endianness;
+    hash = fnv1a((const unsigned char*)&val, sizeof(val), hash);
+    val = shm_endianness;
+    hash = fnv1a((const unsigned char*)&val, sizeof(val), hash);
+
+    uint64_t types[] = {num_packet_types, header_size, id_handle, recv_size};
+    hash = fnv1a((const unsigned char*)types, sizeof(types), hash);
+    for(size_t i = 0; i < num_packet_types; i++) {
+        uint64_t type[] = {packet_types[i].id, packet_types[i].addr, packet_types[i].size};
+        hash = fnv1a((const unsigned char*)type, sizeof(type), hash);
+    }
+
+    // a derived measurement computed differently means something different
+    for(size_t i = 0; i < num_derive_ops; i++) {
+        uint64_t op[] = {derive_ops[i].op, derive_ops[i].handle};
+        hash = fnv1a((const unsigned char*)op, sizeof(op), hash);
+        hash = fnv1a((const unsigned char*)&(derive_ops[i].val), sizeof(double), hash);
+    }
+
+    for(size_t i = 0; i < measurements.size(); i++) {
+        measurement_info_t* info = &(table[i]);
+
+        // include the null terminator so names can't run into each other
+        hash = fnv1a((const unsigned char*)measurements[i].c_str(), measurements[i].size() + 1, hash);
+
+        uint64_t fields[] = {(uint64_t)info->addr, info->size, info->l_padding, info->r_padding,
+                             (uint64_t)info->type, (uint64_t)info->sign};
+        hash = fnv1a((const unsigned char*)fields, sizeof(fields), hash);
+    }
+
+    return hash;
 }
 
 RetType VCM::init() {
-    MsgLogger logger("VCM", "init");
+    std::string cache_file = config_file + CACHE_FILE_EXTENSION;
+
+    if(SUCCESS == load_cache(cache_file)) {
+        return SUCCESS;
+    }
+
+    if(SUCCESS != parse()) {
+        return FAILURE;
+    }
+
+    // the next VCM can skip parsing, it's fine if this fails (e.g. the directory isn't writable)
+    write_cache(cache_file);
+
+    return SUCCESS;
+}
+
+// map a cache file, fails if there isn't one or it's out of date
+RetType VCM::load_cache(std::string cache_file) {
+    struct stat source;
+    if(stat(config_file.c_str(), &source) != 0) {
+        return FAILURE;
+    }
+
+    int fd = open(cache_file.c_str(), O_RDONLY);
+    if(fd == -1) { // nothing cached yet
+        return FAILURE;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(cache_header_t)) {
+        close(fd);
+        return FAILURE;
+    }
+
+    // private and writable so nothing that changes measurement info changes the file
+    unsigned char* addr = (unsigned char*)mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        return FAILURE;
+    }
+
+    cache_header_t* header = (cache_header_t*)addr;
+    if(header->magic != CACHE_MAGIC || header->version != CACHE_VERSION ||
+       header->info_size != sizeof(measurement_info_t) || header->size != (uint64_t)st.st_size ||
+       !cache_matches(header, &source)) {
+        // written by a different version or the config file has changed, parse it again
+        munmap(addr, st.st_size);
+        return FAILURE;
+    }
+
+    if(header->checksum != fnv1a(addr + sizeof(cache_header_t), st.st_size - sizeof(cache_header_t))) {
+        MsgLogger logger("VCM", "load_cache");
+        logger.log_message("Corrupt cache file, parsing config file instead: " + cache_file);
+        munmap(addr, st.st_size);
+        return FAILURE;
+    }
+
+    image = addr;
+    image_size = st.st_size;
+    mapped = true;
+
+    if(SUCCESS != load_image()) {
+        MsgLogger logger("VCM", "load_cache");
+        logger.log_message("Invalid cache file, parsing config file instead: " + cache_file);
+        munmap(image, image_size);
+        image = NULL;
+        image_size = 0;
+        mapped = false;
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+// fill in everything from the compiled layout in 'image'
+RetType VCM::load_image() {
+    cache_header_t* header = (cache_header_t*)image;
+    size_t n = header->num_measurements;
+
+    table = (measurement_info_t*)(image + sizeof(cache_header_t));
+    names = (uint64_t*)(table + n);
+    packet_types = (packet_type_t*)(names + n);
+    num_packet_types = header->num_packet_types;
+    derive_ops = (derive_op_t*)(packet_types + num_packet_types);
+    num_derive_ops = header->num_derive_ops;
+    hash_seeds = (uint32_t*)(derive_ops + num_derive_ops);
+    hash_handles = hash_seeds + header->hash_buckets;
+    num_hash_buckets = header->hash_buckets;
+    num_hash_slots = header->hash_slots;
+
+    size_t strings = (unsigned char*)(hash_handles + num_hash_slots) - image;
+
+    // every name has to be in the string table, which ends with a null terminator
+    if(strings > image_size || image[image_size - 1] != '\0' ||
+       header->device < strings || header->device >= image_size) {
+        return FAILURE;
+    }
+
+    // hash table sizes have to be powers of 2 and every slot has to be a real measurement
+    if((num_hash_buckets & (num_hash_buckets - 1)) || (num_hash_slots & (num_hash_slots - 1)) ||
+       num_hash_buckets == 0 || num_hash_slots < n) {
+        return FAILURE;
+    }
+
+    for(size_t i = 0; i < num_hash_slots; i++) {
+        if(hash_handles[i] != INVALID_HANDLE && hash_handles[i] >= n) {
+            return FAILURE;
+        }
+    }
+
+    if(num_packet_types > 0 && header->id_handle >= n) {
+        return FAILURE;
+    }
+
+    for(size_t i = 0; i < num_derive_ops; i++) {
+        bool uses_handle = (derive_ops[i].op >= DERIVE_INT && derive_ops[i].op <= DERIVE_DOUBLE) ||
+                           derive_ops[i].op == DERIVE_STORE;
+        if(derive_ops[i].op > DERIVE_STORE || (uses_handle && derive_ops[i].handle >= n)) {
+            return FAILURE;
+        }
+    }
+
+    addr = header->addr;
+    port = header->port;
+    protocol = (protocol_t)header->protocol;
+    recv_endianness = (endianness_t)header->recv_endianness;
+    shm_endianness = (endianness_t)header->shm_endianness;
+    packet_size = header->packet_size;
+    header_size = header->header_size;
+    id_handle = header->id_handle;
+    recv_size = header->recv_size;
+    num_derived = header->num_derived;
+    derived_addr = header->derived_addr;
+    device = (const char*)(image + header->device);
+
+    measurements.clear();
+    measurements.reserve(n);
+
+    for(size_t i = 0; i < n; i++) {
+        if(names[i] < strings || names[i] >= image_size) {
+            return FAILURE;
+        }
+
+        measurements.push_back((const char*)(image + names[i]));
+    }
+
+    return SUCCESS;
+}
+
+RetType VCM::write_cache(std::string cache_file) {
+    MsgLogger logger("VCM", "write_cache");
+
+    if(!image) {
+        logger.log_message("No layout to write");
+        return FAILURE;
+    }
+
+    // write somewhere else first so no other process ever maps a partially written cache
+    std::string tmp_file = cache_file + "." + std::to_string(getpid());
+
+    int fd = open(tmp_file.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if(fd == -1) {
+        logger.log_message("Failed to create cache file: " + cache_file);
+        return FAILURE;
+    }
+
+    size_t written = 0;
+    while(written < image_size) {
+        ssize_t n = write(fd, image + written, image_size - written);
+        if(n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    close(fd);
+
+    if(written != image_size || rename(tmp_file.c_str(), cache_file.c_str()) != 0) {
+        logger.log_message("Failed to write cache file: " + cache_file);
+        unlink(tmp_file.c_str());
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+// compiles one derived measurement expression, e.g. "ALT_COUNTS * 0.3048 + 12"
+// grammar:
+//   expr    = term { ('+' | '-') term }
+//   term    = unary { ('*' | '/') unary }
+//   unary   = '-' unary | primary
+//   primary = number | measurement name | '(' expr ')'
+// arithmetic on two constants is done while compiling
+typedef struct {
+    const std::string* expr;
+    size_t pos;
+    std::unordered_map<std::string, uint32_t>* handles; // measurements the expression can use
+    std::vector<measurement_info_t>* infos;
+    std::vector<derive_op_t>* ops;
+    size_t depth; // values on the stack
+    std::string error;
+} expr_compiler_t;
+
+static bool compile_expr(expr_compiler_t* c);
+
+static void skip_space(expr_compiler_t* c) {
+    while(c->pos < c->expr->size() && isspace((unsigned char)(*c->expr)[c->pos])) {
+        c->pos++;
+    }
+}
+
+static char peek(expr_compiler_t* c) {
+    skip_space(c);
+    return c->pos < c->expr->size() ? (*c->expr)[c->pos] : '\0';
+}
+
+static bool emit(expr_compiler_t* c, uint32_t op, handle_t handle = INVALID_HANDLE, double val = 0) {
+    if(op <= DERIVE_DOUBLE) {
+        if(++c->depth > MAX_DERIVE_STACK) {
+            c->error = "expression is too deeply nested";
+            return false;
+        }
+    } else if(op != DERIVE_NEG) {
+        c->depth--; // binary operators and stores take off one more value than they push
+    }
+
+    std::vector<derive_op_t>& ops = *(c->ops);
+    size_t n = ops.size();
+    if(op == DERIVE_NEG && n > 0 && ops[n - 1].op == DERIVE_CONST) {
+        ops[n - 1].val = -ops[n - 1].val;
+        return true;
+    }
+
+    if(op >= DERIVE_ADD && op <= DERIVE_DIV && n > 1 &&
+       ops[n - 1].op == DERIVE_CONST && ops[n - 2].op == DERIVE_CONST) {
+        double a = ops[n - 2].val;
+        double b = ops[n - 1].val;
+        ops.pop_back();
+        switch(op) {
+            case DERIVE_ADD: ops[n - 2].val = a + b; break;
+            case DERIVE_SUB: ops[n - 2].val = a - b; break;
+            case DERIVE_MUL: ops[n - 2].val = a * b; break;
+            default: ops[n - 2].val = a / b; break;
+        }
+        return true;
+    }
+
+    derive_op_t instr;
+    instr.op = op;
+    instr.handle = handle;
+    instr.val = val;
+    ops.push_back(instr);
+    return true;
+}
+
+// push a measurement, converted to a double the same way convert would
+static bool compile_load(expr_compiler_t* c, const std::string& name) {
+    auto it = c->handles->find(name);
+    if(it == c->handles->end()) {
+        c->error = "unknown measurement '" + name + "' (derived measurements can only use ones defined before them)";
+        return false;
+    }
+
+    measurement_info_t* info = &((*c->infos)[it->second]);
+    size_t bits = info->size * 8 - info->l_padding - info->r_padding;
+    if(info->type == INT_TYPE && info->size <= sizeof(uint64_t)) {
+        return emit(c, info->sign == SIGNED_TYPE ? DERIVE_INT : DERIVE_UINT, it->second);
+    } else if(info->type == FLOAT_TYPE && bits == sizeof(float) * 8) {
+        return emit(c, DERIVE_FLOAT, it->second);
+    } else if(info->type == FLOAT_TYPE && bits == sizeof(double) * 8) {
+        return emit(c, DERIVE_DOUBLE, it->second);
+    }
+
+    c->error = "'" + name + "' must be an integer of at most 8 bytes or a 4 or 8 byte float";
+    return false;
+}
+
+static bool compile_primary(expr_compiler_t* c) {
+    char next = peek(c);
+    const char* start = c->expr->c_str() + c->pos;
+
+    if(next == '(') {
+        c->pos++;
+        if(!compile_expr(c)) {
+            return false;
+        }
+        if(peek(c) != ')') {
+            c->error = "missing ')'";
+            return false;
+        }
+        c->pos++;
+        return true;
+    } else if(isdigit((unsigned char)next) || next == '.') {
+        char* end;
+        double val = strtod(start, &end);
+        if(end == start) {
+            c->error = "invalid number";
+            return false;
+        }
+        c->pos += end - start;
+        return emit(c, DERIVE_CONST, INVALID_HANDLE, val);
+    } else if(isalpha((unsigned char)next) || next == '_') {
+        size_t end = c->pos;
+        while(end < c->expr->size() && (isalnum((unsigned char)(*c->expr)[end]) || (*c->expr)[end] == '_')) {
+            end++;
+        }
+        std::string name = c->expr->substr(c->pos, end - c->pos);
+        c->pos = end;
+        return compile_load(c, name);
+    }
+
+    c->error = next == '\0' ? "expression ended early" : std::string("unexpected '") + next + "'";
+    return false;
+}
+
+static bool compile_unary(expr_compiler_t* c) {
+    if(peek(c) == '-') {
+        c->pos++;
+        return compile_unary(c) && emit(c, DERIVE_NEG);
+    }
+    return compile_primary(c);
+}
+
+static bool compile_term(expr_compiler_t* c) {
+    if(!compile_unary(c)) {
+        return false;
+    }
+
+    for(char op = peek(c); op == '*' || op == '/'; op = peek(c)) {
+        c->pos++;
+        if(!compile_unary(c) || !emit(c, op == '*' ? DERIVE_MUL : DERIVE_DIV)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool compile_expr(expr_compiler_t* c) {
+    if(!compile_term(c)) {
+        return false;
+    }
+
+    for(char op = peek(c); op == '+' || op == '-'; op = peek(c)) {
+        c->pos++;
+        if(!compile_term(c) || !emit(c, op == '+' ? DERIVE_ADD : DERIVE_SUB)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// parse the config file and compile the layout into 'image'
+RetType VCM::parse() {
+    MsgLogger logger("VCM", "parse");
+
+    std::vector<std::string> names;
+    std::vector<measurement_info_t> infos;
 
     f = new std::ifstream(config_file.c_str());
     if(!f) {
@@ -94,10 +702,30 @@ RetType VCM::init() {
         return FAILURE;
     }
 
+    // measurements are placed one after another in a stream of bits
+    // measurements sized in bytes start on the next byte, measurements sized in bits don't have to
+    size_t bit_pos = 0;
+
+    // measurements sized in bits, their padding depends on the endianness so it's figured out after parsing
+    std::vector<size_t> packed; // index into infos
+    std::vector<size_t> packed_bit_addr; // bit the measurement starts at
+    std::vector<size_t> packed_bits; // width
+
+    // measurements before the first packet type are the header, every type's measurements follow it
+    std::string id_name = "";
+    std::vector<packet_type_t> types;
+    size_t header_end = 0; // bytes
+
+    // derived measurements are compiled once every measurement they could use is known
+    std::vector<std::string> derived_names;
+    std::vector<std::string> derived_exprs;
+
     // read the config file
     for(std::string line; std::getline(*f,line); ) {
-        if(line == "" || !line.rfind("#",0)) { // blank or comment '#'
-            continue;
+        // comments start with '#' and can follow a measurement
+        size_t comment = line.find('#');
+        if(comment != std::string::npos) {
+            line.erase(comment);
         }
 
         // get 1st + 2nd tokens
@@ -105,11 +733,26 @@ RetType VCM::init() {
         std::istringstream ss(line);
         std::string fst;
         ss >> fst;
+        if(fst == "") { // blank
+            continue;
+        }
         std::string snd;
         ss >> snd;
         std::string third;
         ss >> third;
 
+        // derived measurement line, 'derive NAME = expression'
+        if(fst == "derive") {
+            size_t eq = line.find('=');
+            if(snd == "" || snd.find('=') != std::string::npos || third.size() == 0 || third[0] != '=') {
+                logger.log_message("Derived measurements must look like 'derive NAME = expression': " + line);
+                return FAILURE;
+            }
+            derived_names.push_back(snd);
+            derived_exprs.push_back(line.substr(eq + 1));
+            continue;
+        }
+
         // port or addr or protocol line
         if(snd == "=") {
             if(fst == "addr") {
@@ -135,6 +778,38 @@ RetType VCM::init() {
                 }
             } else if(fst == "name") {
                 device = third;
+            } else if(fst == "id") {
+                id_name = third;
+            } else if(fst == "packet") {
+                packet_type_t type;
+                memset(&type, 0, sizeof(type));
+                try {
+                    unsigned long id = std::stoul(third, NULL, 10);
+                    if(id > UINT32_MAX) {
+                        throw std::out_of_range("packet id");
+                    }
+                    type.id = id;
+                } catch(std::exception& e) {
+                    logger.log_message("Invalid packet id in line: " + line);
+                    return FAILURE;
+                }
+
+                for(packet_type_t& other : types) {
+                    if(other.id == type.id) {
+                        logger.log_message("Packet id used more than once: " + line);
+                        return FAILURE;
+                    }
+                }
+
+                // every type starts on a byte so it can be copied in on its own
+                bit_pos = (bit_pos + 7) & ~((size_t)7);
+                if(types.size() == 0) {
+                    header_end = bit_pos / 8;
+                } else {
+                    types.back().size = bit_pos / 8 - types.back().addr;
+                }
+                type.addr = bit_pos / 8;
+                types.push_back(type);
             } else if(fst == "endianness") {
                 if(third == "little") {
                     recv_endianness = GSW_LITTLE_ENDIAN;
@@ -158,18 +833,48 @@ RetType VCM::init() {
                 return FAILURE;
             }
 
-            measurement_info_t* entry = new measurement_info_t;
-            entry->addr = (void*)packet_size;
+            measurement_info_t info;
+            measurement_info_t* entry = &info;
+
+            // a size ending in 'b' is in bits instead of bytes
+            bool bits = (snd.back() == 'b');
+            if(bits) {
+                snd.pop_back();
+            }
+
+            size_t size = 0;
             try {
-                entry->size = (size_t)(std::stoi(snd, NULL, 10));
+                size = (size_t)(std::stoi(snd, NULL, 10));
                 entry->l_padding = (size_t)(std::stoi(third, NULL, 10));
                 entry->r_padding = (size_t)(std::stoi(fourth, NULL, 10));
             } catch(std::invalid_argument& ia) {
                 logger.log_message("Invalid measurement size: " + line);
                 return FAILURE;
             }
-            packet_size += entry->size;
-            // compressed_size += (entry->size*sizeof(unsigned char)) - (entry->l_padding + entry->r_padding);
+
+            if(bits) {
+                // padding isn't needed when measurements can start on any bit
+                if(size == 0 || size > MAX_PACKED_BITS || entry->l_padding || entry->r_padding) {
+                    logger.log_message("Measurements sized in bits must be 1 to " + std::to_string(MAX_PACKED_BITS) +
+                                       " bits with no padding: " + line);
+                    return FAILURE;
+                }
+
+                packed.push_back(infos.size());
+                packed_bit_addr.push_back(bit_pos);
+                packed_bits.push_back(size);
+                bit_pos += size;
+            } else {
+                if(entry->l_padding + entry->r_padding >= size * 8) {
+                    logger.log_message("Measurement is all padding: " + line);
+                    return FAILURE;
+                }
+
+                bit_pos = (bit_pos + 7) & ~((size_t)7); // next byte
+                entry->addr = (void*)(bit_pos / 8);
+                entry->size = size;
+                bit_pos += size * 8;
+            }
 
 
             // check for type (optional, default is undefined)
@@ -177,8 +882,16 @@ RetType VCM::init() {
                 entry->type = INT_TYPE;
             } else if(fifth == "float") {
                 entry->type = FLOAT_TYPE;
+                if(bits && size != 32) {
+                    logger.log_message("Floats sized in bits must be 32 bits: " + line);
+                    return FAILURE;
+                }
             } else if(fifth == "string") {
                 entry->type = STRING_TYPE;
+                if(bits) {
+                    logger.log_message("Strings can't be sized in bits: " + line);
+                    return FAILURE;
+                }
             } else if(fifth == "") {
                 entry->type = UNDEFINED_TYPE;
             } else {
@@ -197,13 +910,77 @@ RetType VCM::init() {
                 return FAILURE;
             }
 
-            addr_map[fst] = entry;
-            measurements.push_back(fst);
+            infos.push_back(info);
+            names.push_back(fst);
         }
     }
 
     f->close();
 
+    recv_size = (bit_pos + 7) / 8;
+    packet_size = recv_size;
+
+    if(types.size() > 0) {
+        types.back().size = recv_size - types.back().addr;
+    }
+
+    // derived measurements go after everything received, lined up for 8 byte floats
+    num_derived = derived_names.size();
+    derived_addr = 0;
+    if(num_derived > 0) {
+        derived_addr = (recv_size + 7) & ~((size_t)7);
+        packet_size = derived_addr + (num_derived * sizeof(double));
+    }
+
+    // a measurement sized in bits covers every byte it has a bit in, the rest of those bits are padding
+    // little endian packets fill each byte from the least significant bit and big endian packets
+    // from the most significant bit, so either way the padding is the bits around the measurement
+    // once the bytes it covers are put together as one integer
+    for(size_t i = 0; i < packed.size(); i++) {
+        measurement_info_t* entry = &(infos[packed[i]]);
+        size_t first = packed_bit_addr[i] % 8; // bit in the first byte the measurement starts at
+
+        entry->addr = (void*)(packed_bit_addr[i] / 8);
+        entry->size = (first + packed_bits[i] + 7) / 8;
+        if(recv_endianness == GSW_LITTLE_ENDIAN) {
+            entry->r_padding = first;
+            entry->l_padding = entry->size * 8 - packed_bits[i] - first;
+        } else {
+            entry->l_padding = first;
+            entry->r_padding = entry->size * 8 - packed_bits[i] - first;
+        }
+    }
+
+    // received measurements can be swapped to the system's endianness once in decom if each one is
+    // its own bytes, padded and bit packed measurements (which can share a byte, even a 1 byte one)
+    // have to stay in the receiver's endianness
+    shm_endianness = recv_endianness;
+    if(recv_endianness != sys_endianness) {
+        bool swappable = true;
+
+        std::vector<std::pair<size_t, size_t>> spans; // [start, end) of every measurement to swap
+        for(measurement_info_t& info : infos) {
+            if(info.type != STRING_TYPE) {
+                spans.push_back(std::make_pair((size_t)info.addr, (size_t)info.addr + info.size));
+            }
+
+            if(info.l_padding || info.r_padding) {
+                swappable = false;
+            }
+        }
+        std::sort(spans.begin(), spans.end());
+
+        for(size_t i = 0; i < spans.size(); i++) {
+            if(spans[i].second - spans[i].first > MAX_SWAP_SIZE || (i > 0 && spans[i].first < spans[i - 1].second)) {
+                swappable = false;
+            }
+        }
+
+        if(swappable) {
+            shm_endianness = sys_endianness;
+        }
+    }
+
     // check for unset mandatory configuration items
     if(protocol == PROTOCOL_NOT_SET) {
         logger.log_message("Config file missing protocol: " + config_file);
@@ -213,5 +990,209 @@ RetType VCM::init() {
         return FAILURE;
     }
 
-    return SUCCESS;
+    // the packet type is read before anything else, so it has to be a small integer in the header
+    uint32_t id = INVALID_HANDLE;
+    if(types.size() > 0 || id_name != "") {
+        if(types.size() == 0 || id_name == "") {
+            logger.log_message("Config file needs both an id measurement and packet types: " + config_file);
+            return FAILURE;
+        }
+
+        for(size_t i = 0; i < names.size(); i++) {
+            if(names[i] == id_name) {
+                id = i;
+            }
+        }
+
+        if(id == INVALID_HANDLE || (size_t)infos[id].addr + infos[id].size > header_end ||
+           infos[id].type != INT_TYPE || infos[id].size > sizeof(uint64_t)) {
+            logger.log_message("Packet id must be an integer measurement in the header of at most 8 bytes: " + id_name);
+            return FAILURE;
+        }
+    }
+
+    struct stat source;
+    if(stat(config_file.c_str(), &source) != 0) {
+        logger.log_message("Failed to stat config file: " + config_file);
+        return FAILURE;
+    }
+
+    // each name maps to its last measurement if a name is used more than once
+    std::unordered_map<std::string, uint32_t> unique;
+    for(size_t i = 0; i < names.size(); i++) {
+        unique[names[i]] = i;
+    }
+
+    // derived measurements come after the received ones, in the order they're defined
+    // each can use any received measurement and the derived measurements before it
+    std::vector<derive_op_t> ops;
+    for(size_t i = 0; i < num_derived; i++) {
+        if(unique.find(derived_names[i]) != unique.end()) {
+            logger.log_message("Derived measurement has the same name as another measurement: " + derived_names[i]);
+            return FAILURE;
+        }
+
+        expr_compiler_t c;
+        c.expr = &(derived_exprs[i]);
+        c.pos = 0;
+        c.handles = &unique;
+        c.infos = &infos;
+        c.ops = &ops;
+        c.depth = 0;
+
+        bool ok = compile_expr(&c);
+        if(ok && peek(&c) != '\0') {
+            c.error = std::string("unexpected '") + peek(&c) + "'";
+            ok = false;
+        }
+
+        if(!ok) {
+            logger.log_message("Invalid expression for derived measurement " + derived_names[i] + ": " + c.error);
+            return FAILURE;
+        }
+
+        measurement_info_t info;
+        info.addr = (void*)(derived_addr + (i * sizeof(double)));
+        info.size = sizeof(double);
+        info.l_padding = 0;
+        info.r_padding = 0;
+        info.type = FLOAT_TYPE;
+        info.sign = SIGNED_TYPE;
+
+        uint32_t handle = infos.size();
+        emit(&c, DERIVE_STORE, handle);
+
+        infos.push_back(info);
+        names.push_back(derived_names[i]);
+        unique[derived_names[i]] = handle;
+    }
+
+    // build the perfect hash, buckets with the most names are the hardest to place so go first
+    uint32_t n = infos.size();
+    uint32_t buckets = next_pow2(n / 2 + 1);
+    uint32_t slots = next_pow2(2 * n + 1); // at most half full so seeds are quick to find
+
+    std::vector<std::vector<uint64_t>> bucket_hashes(buckets);
+    std::vector<std::vector<uint32_t>> bucket_handles(buckets);
+    for(auto& it : unique) {
+        uint64_t hash = fnv1a((const unsigned char*)it.first.c_str(), it.first.size());
+        bucket_hashes[hash & (buckets - 1)].push_back(hash);
+        bucket_handles[hash & (buckets - 1)].push_back(it.second);
+    }
+
+    std::vector<uint32_t> order(buckets);
+    for(uint32_t b = 0; b < buckets; b++) {
+        order[b] = b;
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+        return bucket_hashes[x].size() > bucket_hashes[y].size();
+    });
+
+    std::vector<uint32_t> seeds(buckets, 0);
+    std::vector<uint32_t> handles(slots, INVALID_HANDLE);
+    std::vector<uint32_t> placed;
+    for(uint32_t b : order) {
+        if(bucket_hashes[b].size() == 0) {
+            break;
+        }
+
+        uint32_t seed = 0;
+        for(; seed < MAX_HASH_SEED; seed++) {
+            placed.clear();
+            for(uint64_t hash : bucket_hashes[b]) {
+                uint32_t slot = hash_slot(hash, seed, slots);
+                if(handles[slot] != INVALID_HANDLE ||
+                   std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+                    break;
+                }
+                placed.push_back(slot);
+            }
+
+            if(placed.size() == bucket_hashes[b].size()) {
+                break;
+            }
+        }
+
+        if(seed == MAX_HASH_SEED) {
+            logger.log_message("Failed to build measurement hash table: " + config_file);
+            return FAILURE;
+        }
+
+        seeds[b] = seed;
+        for(size_t i = 0; i < placed.size(); i++) {
+            handles[placed[i]] = bucket_handles[b][i];
+        }
+    }
+
+    // compile the layout
+    size_t strings = sizeof(cache_header_t) + (n * (sizeof(measurement_info_t) + sizeof(uint64_t))) +
+                     (types.size() * sizeof(packet_type_t)) + (ops.size() * sizeof(derive_op_t)) +
+                     ((buckets + slots) * sizeof(uint32_t));
+    image_size = strings + device.size() + 1;
+    for(std::string& name : names) {
+        image_size += name.size() + 1;
+    }
+
+    image = new unsigned char[image_size];
+    memset(image, 0, image_size);
+    mapped = false;
+
+    cache_header_t* header = (cache_header_t*)image;
+    header->magic = CACHE_MAGIC;
+    header->version = CACHE_VERSION;
+    header->size = image_size;
+    header->info_size = sizeof(measurement_info_t);
+    header->source_dev = source.st_dev;
+    header->source_ino = source.st_ino;
+    header->source_size = source.st_size;
+    header->source_mtime_sec = source.st_mtim.tv_sec;
+    header->source_mtime_nsec = source.st_mtim.tv_nsec;
+    header->addr = addr;
+    header->port = port;
+    header->protocol = protocol;
+    header->recv_endianness = recv_endianness;
+    header->shm_endianness = shm_endianness;
+    header->packet_size = packet_size;
+    header->num_measurements = n;
+    header->hash_buckets = buckets;
+    header->hash_slots = slots;
+    header->header_size = header_end;
+    header->id_handle = id;
+    header->num_packet_types = types.size();
+    header->recv_size = recv_size;
+    header->derived_addr = derived_addr;
+    header->num_derived = num_derived;
+    header->num_derive_ops = ops.size();
+
+    measurement_info_t* info_table = (measurement_info_t*)(image + sizeof(cache_header_t));
+    uint64_t* name_table = (uint64_t*)(info_table + n);
+    packet_type_t* type_table = (packet_type_t*)(name_table + n);
+    derive_op_t* op_table = (derive_op_t*)(type_table + types.size());
+    uint32_t* seed_table = (uint32_t*)(op_table + ops.size());
+    uint32_t* handle_table = seed_table + buckets;
+
+    if(types.size() > 0) {
+        memcpy(type_table, types.data(), types.size() * sizeof(packet_type_t));
+    }
+    if(ops.size() > 0) {
+        memcpy(op_table, ops.data(), ops.size() * sizeof(derive_op_t));
+    }
+    memcpy(seed_table, seeds.data(), buckets * sizeof(uint32_t));
+    memcpy(handle_table, handles.data(), slots * sizeof(uint32_t));
+
+    size_t offset = strings;
+    header->device = offset;
+    memcpy(image + offset, device.c_str(), device.size() + 1);
+    offset += device.size() + 1;
+
+    for(size_t i = 0; i < n; i++) {
+        info_table[i] = infos[i];
+        name_table[i] = offset;
+        memcpy(image + offset, names[i].c_str(), names[i].size() + 1);
+        offset += names[i].size() + 1;
+    }
+
+    header->checksum = fnv1a(image + sizeof(cache_header_t), image_size - sizeof(cache_header_t));
+
+    return load_image();
 }
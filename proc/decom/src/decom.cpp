@@ -1,9 +1,14 @@
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
 #include <csignal>
 #include "lib/nm/nm.h"
 #include "lib/shm/shm.h"
 #include "lib/dls/dls.h"
 #include "lib/vcm/vcm.h"
+#include "lib/convert/convert.h"
 #include "common/types.h"
 #include <csignal>
 #include <string>
@@ -28,9 +33,15 @@ void sighandler(int signum) {
 
 int main(int argc, char** argv) {
     // interpret the 1st argument as a config_file location if available
+    // option -uring to receive with io_uring, falls back to the socket if the kernel doesn't support it
     std::string config_file = "";
-    if(argc > 1) {
-        config_file = argv[1];
+    backend_t backend = SOCKET_BACKEND;
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-uring")) {
+            backend = URING_BACKEND;
+        } else {
+            config_file = argv[i];
+        }
     }
 
     MsgLogger logger("DECOM");
@@ -50,12 +61,16 @@ int main(int argc, char** argv) {
         vcm = new VCM(config_file); // use specified config file
     }
 
-    net = new NetworkManager(vcm);
+    net = new NetworkManager(vcm, backend);
     if(FAILURE == net->Open()) {
         logger.log_message("failed to open network manager");
         return -1;
     }
 
+    if(net->backend == URING_BACKEND) {
+        logger.log_message("receiving with io_uring");
+    }
+
     // attach to shared memory
     if(FAILURE == attach_to_shm(vcm)) {
         logger.log_message("unable to attach to shared memory");
@@ -69,20 +84,132 @@ int main(int argc, char** argv) {
     }
 
 
+    // copy of the packet in shared memory, derived measurements are computed from it
+    // with packet types it still has the latest measurements of every other type
+    unsigned char* packet = new unsigned char[vcm->packet_size];
+    memset(packet, 0, vcm->packet_size);
+
+    // measurements are swapped to the system's endianness here so readers never have to
+    // fails if the VCM didn't keep shared memory in the receiver's endianness when it had to
+    convert::Swapper swapper;
+    if(FAILURE == swapper.init(vcm)) {
+        logger.log_message("unable to swap received packets to the endianness of shared memory");
+        return FAILURE;
+    }
+
+    // false while packets can't be written in the current layout
+    bool writing = true;
+
+    // decom can't sleep between tries like the apps, so a failed rebind is only tried again after
+    // REBIND_RETRY_USEC and only logged once for each published layout
+    bool rebind_failed = false;
+    uint32_t failed_generation = 0;
+    struct timespec failed_at;
+    memset(&failed_at, 0, sizeof(failed_at));
+
+    // every datagram waiting on the socket is received at once
+    batch_t batch;
+
+    // sleep until a datagram arrives or a message is queued to send instead of spinning
+    int epfd = epoll_create1(0);
+    if(epfd == -1) {
+        logger.log_message("unable to create epoll instance");
+        return -1;
+    }
+
+    int fds[2] = {net->ReceiveFd(), net->QueueFd()};
+    for(int fd : fds) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if(-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            logger.log_message("unable to wait on network manager");
+            return -1;
+        }
+    }
+
+    struct epoll_event events[2];
+
     PacketLogger plogger(vcm->device);
     while(1) {
+        int n = epoll_wait(epfd, events, 2, -1);
+        if(n == -1) {
+            if(errno != EINTR) {
+                logger.log_message("epoll_wait failed, " + std::string(strerror(errno)));
+            }
+            continue;
+        }
+
+        // level triggered, so anything left over after one send or one batch wakes us right back up
+        bool readable = false;
+        bool queued = false;
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.fd == net->ReceiveFd()) {
+                readable = true;
+            } else if(events[i].data.fd == net->QueueFd()) {
+                queued = true;
+            }
+        }
+
         // send any outgoing messages
-        net->Send(); // don't care about the return
-
-        // read any incoming message and write it to shared memory
-        if(SUCCESS == net->Receive()) {
-            if(net->in_size != vcm->packet_size) {
-                logger.log_message("Packet size mismatch, " + std::to_string(vcm->packet_size) +
-                                   " != " + std::to_string(net->in_size) + " (received)");
-            } else { // only write the packet to shared mem if it's the correct size
-                write_to_shm((void*)net->in_buffer, net->in_size);
+        if(queued) {
+            net->Send(); // don't care about the return
+        }
+
+        // read any incoming messages and write them to shared memory
+        if(readable && SUCCESS == net->ReceiveBatch(&batch)) {
+            // switch to a new layout as soon as it's published (shmctl -reload), nothing written
+            // in the old layout makes it into shared memory after that
+            // the network manager keeps using the address and port it opened with
+            if(layout_changed()) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                uint64_t since_failed = (now.tv_sec - failed_at.tv_sec) * 1000000 + (now.tv_nsec - failed_at.tv_nsec) / 1000;
+                if(!rebind_failed || since_failed >= REBIND_RETRY_USEC) {
+                    uint32_t gen = get_generation();
+                    if(SUCCESS == rebind_shm()) {
+                        logger.log_message("switched to new layout, packet size is " + std::to_string(vcm->packet_size));
+                        rebind_failed = false;
+
+                        // shared memory was cleared when the layout was published
+                        delete[] packet;
+                        packet = new unsigned char[vcm->packet_size];
+                        memset(packet, 0, vcm->packet_size);
+
+                        writing = (SUCCESS == swapper.init(vcm));
+                        if(!writing) {
+                            logger.log_message("unable to swap packets in the new layout, packets won't be written until it's fixed");
+                        }
+                    } else {
+                        if(!rebind_failed || gen != failed_generation) {
+                            logger.log_message("failed to switch to new layout, packets won't be written until it's fixed");
+                        }
+
+                        rebind_failed = true;
+                        failed_generation = gen;
+                        failed_at = now;
+                        writing = false;
+                    }
+                }
+            }
+
+            for(size_t i = 0; i < batch.count; i++) {
+                // only write the packet to shared mem if it's the correct size (and a known type)
+                packet_type_t* type = NULL;
+                if(FAILURE == vcm->unpack(packet, batch.data[i], batch.size[i], &type)) {
+                    logger.log_message("Packet size mismatch or unknown packet type, " + std::to_string(batch.size[i]) +
+                                       " bytes (received)");
+                } else if(writing) {
+                    swapper.swap_packet(packet, type);
+
+                    // derived measurements are computed once here instead of by every reader
+                    bool derived = (vcm->num_derived > 0 && SUCCESS == convert::derive(vcm, packet));
+
+                    write_packet_to_shm(packet, type, derived);
+                }
+                plogger.log_packet((unsigned char*)batch.data[i], batch.size[i]); // log the packet either way
             }
-            plogger.log_packet((unsigned char*)net->in_buffer, net->in_size); // log the packet either way
         }
     }
 }
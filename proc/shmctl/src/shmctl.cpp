@@ -8,8 +8,20 @@
 #include "common/types.h"
 
 // run as shmctl -on or shmctl -off to create and destroy shared memory
+// run as shmctl -recover to release locks held by a process that died while reading or writing
+// run as shmctl -reload after editing the config file to switch every attached process to the new layout
+// without recreating shared memory, the device name can't change and the packet has to fit (see -reserve)
 // option -f argument to specify VCM config file (current default used otherwise)
-// use as shmctl (-on | -off) [-f path_to_config_file]
+// option -lock to create shared memory where readers lock out writers (only used with -on)
+// by default readers never lock, so a reader dying can't stall writers
+// option -seqlock is the default, kept for scripts that already use it (only used with -on)
+// option -history argument to keep a ring of the last N packets written (only used with -on)
+// option -reserve argument to set aside N extra bytes for the packet so larger layouts can be reloaded (only used with -on)
+// option -posix to create POSIX shared memory (shm_open/mmap) instead of System V (only used with -on)
+// options -hugepages, -populate, and -mlock back shared memory with huge pages, fault in every page
+// when attaching, and lock it in memory (only used with -on, every attaching process follows them)
+// use as shmctl (-on | -off | -recover | -reload) [-f path_to_config_file] [-lock | -seqlock] [-history N] [-reserve N]
+//               [-posix] [-hugepages] [-populate] [-mlock]
 
 using namespace vcm;
 using namespace shm;
@@ -17,6 +29,32 @@ using namespace dls;
 
 bool on = false;
 bool off = false;
+bool recover = false;
+bool reload = false;
+shm_mode_t mode = SEQLOCK_MODE; // not create_shm's default (LOCK_MODE), so a reader killed mid-read can't stall decom
+size_t history_slots = 0;
+size_t reserve = 0;
+int options = 0;
+
+// parse a non-negative integer argument, returns -1 if invalid (or out of range)
+long parse_arg(const char* arg) {
+    long val = -1;
+    size_t end = 0;
+    try {
+        val = std::stol(arg, &end, 10);
+    } catch(std::invalid_argument& ia) {
+        return -1;
+    } catch(std::out_of_range& oor) {
+        return -1;
+    }
+
+    // trailing characters, e.g. "10k"
+    if(arg[end] != '\0') {
+        return -1;
+    }
+
+    return val < 0 ? -1 : val;
+}
 
 int main(int argc, char* argv[]) {
     MsgLogger logger("SHMCTL");
@@ -24,12 +62,52 @@ int main(int argc, char* argv[]) {
     std::string config_file = "";
 
     for(int i = 1; i < argc; i++) {
-        if(!strcmp(argv[i], "-on") && !off) {
+        if(!strcmp(argv[i], "-on") && !off && !recover && !reload) {
             on = true;
-        } else if(!strcmp(argv[i], "-off") && !on) {
+        } else if(!strcmp(argv[i], "-off") && !on && !recover && !reload) {
             off = true;
+        } else if(!strcmp(argv[i], "-recover") && !on && !off && !reload) {
+            recover = true;
+        } else if(!strcmp(argv[i], "-reload") && !on && !off && !recover) {
+            reload = true;
+        } else if(!strcmp(argv[i], "-lock")) {
+            mode = LOCK_MODE;
+        } else if(!strcmp(argv[i], "-seqlock")) {
+            mode = SEQLOCK_MODE;
+        } else if(!strcmp(argv[i], "-posix")) {
+            options |= SHM_OPT_POSIX;
+        } else if(!strcmp(argv[i], "-hugepages")) {
+            options |= SHM_OPT_HUGEPAGES;
+        } else if(!strcmp(argv[i], "-populate")) {
+            options |= SHM_OPT_POPULATE;
+        } else if(!strcmp(argv[i], "-mlock")) {
+            options |= SHM_OPT_MLOCK;
+        } else if(!strcmp(argv[i], "-history")) {
+            if(i + 1 >= argc) {
+                logger.log_message("Must specify a number of packets after using the -history option");
+                printf("Must specify a number of packets after using the -history option\n");
+                return -1;
+            }
+            long slots = parse_arg(argv[++i]);
+            if(slots < 0 || slots > UINT32_MAX) { // the history ring size is kept as 32 bits
+                printf("Invalid number of history packets: %s\n", argv[i]);
+                return -1;
+            }
+            history_slots = (size_t)slots;
+        } else if(!strcmp(argv[i], "-reserve")) {
+            if(i + 1 >= argc) {
+                logger.log_message("Must specify a number of bytes after using the -reserve option");
+                printf("Must specify a number of bytes after using the -reserve option\n");
+                return -1;
+            }
+            long bytes = parse_arg(argv[++i]);
+            if(bytes < 0) {
+                printf("Invalid number of bytes to reserve: %s\n", argv[i]);
+                return -1;
+            }
+            reserve = (size_t)bytes;
         } else if(!strcmp(argv[i], "-f")) {
-            if(i + 1 > argc) {
+            if(i + 1 >= argc) {
                 logger.log_message("Must specify a path to the config file after using the -f option");
                 printf("Must specify a path to the config file after using the -f option\n");
                 return -1;
@@ -60,7 +138,7 @@ int main(int argc, char* argv[]) {
     if(on) {
         printf("creating shared memory\n");
         logger.log_message("creating shared memory");
-        if(FAILURE == create_shm(vcm)) {
+        if(FAILURE == create_shm(vcm, mode, history_slots, options, reserve)) {
             printf("Failed to create shared memory\n");
             logger.log_message("Failed to create shared memory");
             return FAILURE;
@@ -79,5 +157,44 @@ int main(int argc, char* argv[]) {
             return FAILURE;
         }
         return SUCCESS;
+    } else if(recover) {
+        printf("recovering shared memory locks\n");
+        logger.log_message("recovering shared memory locks");
+        if(FAILURE == attach_to_shm(vcm)) {
+            printf("Shared memory not created, nothing to recover\n");
+            logger.log_message("Shared memory not created, nothing to recover");
+            return FAILURE;
+        }
+        bool recovered = false;
+        if(FAILURE == recover_shm(&recovered)) {
+            printf("Failed to recover shared memory locks\n");
+            logger.log_message("Failed to recover shared memory locks");
+            return FAILURE;
+        }
+        if(recovered) {
+            printf("released locks held by a dead process\n");
+        } else {
+            printf("no locks were stuck\n");
+        }
+        return SUCCESS;
+    } else if(reload) {
+        printf("publishing layout\n");
+        logger.log_message("publishing layout");
+        Writer writer;
+        if(FAILURE == writer.attach(vcm)) {
+            printf("Shared memory not created, nothing to reload\n");
+            logger.log_message("Shared memory not created, nothing to reload");
+            return FAILURE;
+        }
+        if(!writer.layout_changed()) {
+            printf("layout is already up to date\n");
+            return SUCCESS;
+        }
+        if(FAILURE == writer.publish()) {
+            printf("Failed to publish layout, it may not fit in shared memory (see -reserve)\n");
+            logger.log_message("Failed to publish layout");
+            return FAILURE;
+        }
+        return SUCCESS;
     }
 }
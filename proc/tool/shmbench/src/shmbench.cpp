@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include "lib/vcm/vcm.h"
+#include "lib/shm/shm.h"
+#include "common/types.h"
+
+// benchmarks shared memory contention and write-to-read latency
+// creates its own shared memory for the vehicle, so shmctl must be off for that vehicle
+// every writer and reader is a thread with its own attachment to shared memory
+//
+// option -f argument to specify VCM config file (current default used otherwise)
+// option -writers argument for the number of writer threads (default 1)
+// option -readers argument for the number of reader threads (default 1)
+// option -size argument for the packet size in bytes (default is the vehicle's packet size)
+// option -rate argument for writes per second per writer (default 0, as fast as possible)
+// option -mode argument for how readers read: read, if_updated, or block (default block)
+// option -time argument for how many seconds to run (default 5)
+// option -lock to benchmark readers that lock out writers instead of lock-free readers
+// use as shmbench [-f path_to_config_file] [-writers N] [-readers N] [-size N] [-rate N]
+//                 [-mode read|if_updated|block] [-time N] [-lock]
+//
+// latency is from just before a packet is written to just after a reader copies it
+// missed updates are packets a reader never saw because a newer one overwrote them first
+
+using namespace vcm;
+using namespace shm;
+
+#define NSEC_PER_SEC 1000000000
+
+typedef enum {
+    READ, READ_IF_UPDATED, READ_BLOCK
+} read_mode_t;
+
+// the start of every packet written
+typedef struct {
+    uint64_t seq; // 0 is never written, so readers ignore cleared packets
+    uint64_t timestamp; // CLOCK_MONOTONIC nanoseconds
+} bench_header_t;
+
+typedef struct {
+    uint64_t reads;
+    uint64_t missed;
+    std::vector<uint64_t> latencies;
+} reader_stats_t;
+
+VCM* vehicle;
+size_t packet_size;
+read_mode_t read_mode = READ_BLOCK;
+uint64_t rate = 0;
+
+bool running = true;
+uint64_t next_seq = 1;
+
+uint64_t now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((uint64_t)t.tv_sec * NSEC_PER_SEC) + t.tv_nsec;
+}
+
+void writer_thread(uint64_t* writes) {
+    Writer writer;
+    if(FAILURE == writer.attach(vehicle)) {
+        printf("writer failed to attach to shared memory\n");
+        return;
+    }
+
+    unsigned char* buff = new unsigned char[packet_size];
+    memset(buff, 0, packet_size);
+    bench_header_t* header = (bench_header_t*)buff;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while(__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        if(rate) {
+            next.tv_nsec += NSEC_PER_SEC / rate;
+            while(next.tv_nsec >= NSEC_PER_SEC) {
+                next.tv_sec++;
+                next.tv_nsec -= NSEC_PER_SEC;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+
+        header->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+        header->timestamp = now();
+        if(SUCCESS == writer.write(buff, packet_size)) {
+            (*writes)++;
+        }
+    }
+
+    delete[] buff;
+}
+
+void reader_thread(reader_stats_t* stats) {
+    Reader reader;
+    if(FAILURE == reader.attach(vehicle)) {
+        printf("reader failed to attach to shared memory\n");
+        return;
+    }
+
+    unsigned char* buff = new unsigned char[packet_size];
+    bench_header_t* header = (bench_header_t*)buff;
+    uint64_t last_seq = 0;
+    RetType ret = FAILURE;
+
+    while(__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        switch(read_mode) {
+            case READ:
+                ret = reader.read(buff, packet_size);
+                break;
+            case READ_IF_UPDATED:
+                ret = reader.read_if_updated(buff, packet_size);
+                break;
+            case READ_BLOCK:
+                ret = reader.read_block(buff, packet_size);
+                break;
+        }
+
+        if(ret == FAILURE) {
+            continue;
+        }
+
+        uint64_t recv_time = now();
+        stats->reads++;
+
+        // with more than one writer packets can land out of order, only count newer ones
+        if(header->seq <= last_seq) {
+            continue;
+        }
+
+        if(last_seq != 0) {
+            stats->missed += header->seq - last_seq - 1;
+        }
+        last_seq = header->seq;
+
+        stats->latencies.push_back(recv_time - header->timestamp);
+    }
+
+    delete[] buff;
+}
+
+// value at 'p' (0 to 1) of sorted samples
+uint64_t percentile(std::vector<uint64_t>& sorted, double p) {
+    if(sorted.size() == 0) {
+        return 0;
+    }
+
+    size_t i = (size_t)(p * (sorted.size() - 1));
+    return sorted[i];
+}
+
+// parse a non-negative integer argument, returns -1 if invalid
+long parse_arg(const char* arg) {
+    long val = -1;
+    try {
+        val = std::stol(arg, NULL, 10);
+    } catch(std::invalid_argument& ia) {
+        // handled by the caller
+    } catch(std::out_of_range& oor) {
+        // handled by the caller
+    }
+    return val;
+}
+
+int main(int argc, char* argv[]) {
+    std::string config_file = "";
+    long writers = 1;
+    long readers = 1;
+    long size = 0;
+    long seconds = 5;
+    shm_mode_t mode = SEQLOCK_MODE;
+
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-lock")) {
+            mode = LOCK_MODE;
+            continue;
+        }
+
+        if(i + 1 >= argc) {
+            printf("Invalid argument: %s\n", argv[i]);
+            return -1;
+        }
+
+        const char* arg = argv[++i];
+        long val = parse_arg(arg);
+
+        if(!strcmp(argv[i - 1], "-f")) {
+            config_file = arg;
+        } else if(!strcmp(argv[i - 1], "-mode")) {
+            if(!strcmp(arg, "read")) {
+                read_mode = READ;
+            } else if(!strcmp(arg, "if_updated")) {
+                read_mode = READ_IF_UPDATED;
+            } else if(!strcmp(arg, "block")) {
+                read_mode = READ_BLOCK;
+            } else {
+                printf("Invalid read mode: %s\n", arg);
+                return -1;
+            }
+        } else if(val < 0) {
+            printf("Invalid value for %s: %s\n", argv[i - 1], arg);
+            return -1;
+        } else if(!strcmp(argv[i - 1], "-writers")) {
+            writers = val;
+        } else if(!strcmp(argv[i - 1], "-readers")) {
+            readers = val;
+        } else if(!strcmp(argv[i - 1], "-size")) {
+            size = val;
+        } else if(!strcmp(argv[i - 1], "-rate")) {
+            rate = (uint64_t)val;
+        } else if(!strcmp(argv[i - 1], "-time")) {
+            seconds = val;
+        } else {
+            printf("Invalid argument: %s\n", argv[i - 1]);
+            return -1;
+        }
+    }
+
+    if(writers < 1 || readers < 1) {
+        printf("Need at least one writer and one reader\n");
+        return -1;
+    }
+
+    try {
+        if(config_file == "") {
+            vehicle = new VCM(); // use default config file
+        } else {
+            vehicle = new VCM(config_file); // use specified config file
+        }
+    } catch (const std::runtime_error& e) {
+        std::cout << e.what() << '\n';
+        return -1;
+    }
+
+    // benchmark a different packet size than the vehicle's
+    // writes still track every measurement that fits in the packet
+    if(size) {
+        vehicle->packet_size = size;
+    }
+    packet_size = vehicle->packet_size;
+
+    if(packet_size < sizeof(bench_header_t)) {
+        printf("Packet size must be at least %lu bytes\n", sizeof(bench_header_t));
+        return -1;
+    }
+
+    if(FAILURE == create_shm(vehicle, mode)) {
+        printf("Failed to create shared memory, make sure shmctl is off for this vehicle\n");
+        return -1;
+    }
+
+    std::vector<uint64_t> writes(writers, 0);
+    std::vector<reader_stats_t> stats(readers);
+    std::vector<std::thread> threads;
+
+    printf("%ld writer(s), %ld reader(s), %lu byte packets, ", writers, readers, packet_size);
+    if(rate) {
+        printf("%lu writes/s per writer, ", rate);
+    } else {
+        printf("unlimited write rate, ");
+    }
+    printf("%s, %s for %ld s\n", read_mode == READ ? "read" : read_mode == READ_IF_UPDATED ? "if_updated" : "block",
+           mode == SEQLOCK_MODE ? "seqlock" : "lock", seconds);
+
+    for(long i = 0; i < readers; i++) {
+        threads.push_back(std::thread(reader_thread, &stats[i]));
+    }
+    for(long i = 0; i < writers; i++) {
+        threads.push_back(std::thread(writer_thread, &writes[i]));
+    }
+
+    struct timespec duration;
+    duration.tv_sec = seconds;
+    duration.tv_nsec = 0;
+    nanosleep(&duration, NULL);
+
+    __atomic_store_n(&running, false, __ATOMIC_RELAXED);
+
+    // wake up any readers blocked waiting for a write, a cleared packet has sequence number 0
+    Writer waker;
+    if(SUCCESS == waker.attach(vehicle)) {
+        waker.clear();
+        waker.detach();
+    }
+
+    for(std::thread& t : threads) {
+        t.join();
+    }
+
+    uint64_t total_writes = 0;
+    for(uint64_t w : writes) {
+        total_writes += w;
+    }
+
+    uint64_t total_reads = 0;
+    uint64_t total_missed = 0;
+    std::vector<uint64_t> latencies;
+    for(reader_stats_t& s : stats) {
+        total_reads += s.reads;
+        total_missed += s.missed;
+        latencies.insert(latencies.end(), s.latencies.begin(), s.latencies.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    double elapsed = seconds ? (double)seconds : 1;
+    printf("writes/s: %.0f\n", total_writes / elapsed);
+    printf("reads/s: %.0f\n", total_reads / elapsed);
+    printf("latency (us): p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+           percentile(latencies, 0.5) / 1000.0, percentile(latencies, 0.99) / 1000.0,
+           percentile(latencies, 0.999) / 1000.0, percentile(latencies, 1) / 1000.0);
+    printf("missed updates: %lu (%.2f%% of writes per reader)\n", total_missed,
+           total_writes ? (100.0 * total_missed) / (total_writes * readers) : 0);
+
+    Writer destroyer;
+    if(FAILURE == destroyer.attach(vehicle) || FAILURE == destroyer.destroy()) {
+        printf("Failed to destroy shared memory, remove it with shmctl -off\n");
+        return -1;
+    }
+
+    return 0;
+}
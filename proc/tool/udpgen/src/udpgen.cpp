@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include "lib/vcm/vcm.h"
+#include "common/types.h"
+
+// sends packets the size a vehicle's config file expects to decom over UDP, for testing and benchmarking
+// decom's receive path (e.g. decom -uring) over loopback
+// every packet starts with a big endian 32 bit sequence number, the rest is zeros
+//
+// option -f argument to specify VCM config file (current default used otherwise)
+// option -addr argument for the address decom is listening on (default 127.0.0.1)
+// option -count argument for the number of packets to send (default 100000)
+// option -rate argument for packets per second (default 0, as fast as possible)
+// use as udpgen [-f path_to_config_file] [-addr address] [-count N] [-rate N]
+//
+// configs with packet types aren't supported, the generator can't fill in the id
+
+using namespace vcm;
+
+#define NSEC_PER_SEC 1000000000
+
+// parse a non-negative integer argument, returns -1 if invalid
+long parse_arg(const char* arg) {
+    long val = -1;
+    try {
+        val = std::stol(arg, NULL, 10);
+    } catch(std::invalid_argument& ia) {
+        // handled by the caller
+    } catch(std::out_of_range& oor) {
+        // handled by the caller
+    }
+    return val;
+}
+
+int main(int argc, char* argv[]) {
+    std::string config_file = "";
+    std::string addr = "127.0.0.1";
+    long count = 100000;
+    long rate = 0;
+
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            printf("Invalid argument: %s\n", argv[i]);
+            return -1;
+        }
+
+        const char* arg = argv[++i];
+        long val = parse_arg(arg);
+
+        if(!strcmp(argv[i - 1], "-f")) {
+            config_file = arg;
+        } else if(!strcmp(argv[i - 1], "-addr")) {
+            addr = arg;
+        } else if(val < 0) {
+            printf("Invalid value for %s: %s\n", argv[i - 1], arg);
+            return -1;
+        } else if(!strcmp(argv[i - 1], "-count")) {
+            count = val;
+        } else if(!strcmp(argv[i - 1], "-rate")) {
+            rate = val;
+        } else {
+            printf("Invalid argument: %s\n", argv[i - 1]);
+            return -1;
+        }
+    }
+
+    VCM* vcm;
+    try {
+        if(config_file == "") {
+            vcm = new VCM(); // use default config file
+        } else {
+            vcm = new VCM(config_file); // use specified config file
+        }
+    } catch (const std::runtime_error& e) {
+        std::cout << e.what() << '\n';
+        return -1;
+    }
+
+    if(vcm->num_packet_types) {
+        printf("Config files with packet types aren't supported\n");
+        return -1;
+    }
+
+    size_t size = vcm->recv_size;
+    if(size < sizeof(uint32_t)) {
+        printf("Packet size must be at least %lu bytes\n", sizeof(uint32_t));
+        return -1;
+    }
+
+    struct sockaddr_in dst;
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(vcm->port);
+    if(1 != inet_pton(AF_INET, addr.c_str(), &(dst.sin_addr))) {
+        printf("Invalid address: %s\n", addr.c_str());
+        return -1;
+    }
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sockfd < 0) {
+        printf("Failed to create socket\n");
+        return -1;
+    }
+
+    unsigned char* buff = new unsigned char[size];
+    memset(buff, 0, size);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct timespec next = start;
+
+    long sent = 0;
+    for(long i = 0; i < count; i++) {
+        if(rate) {
+            next.tv_nsec += NSEC_PER_SEC / rate;
+            while(next.tv_nsec >= NSEC_PER_SEC) {
+                next.tv_sec++;
+                next.tv_nsec -= NSEC_PER_SEC;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+
+        uint32_t seq = htonl((uint32_t)i);
+        memcpy(buff, &seq, sizeof(uint32_t));
+        if(sendto(sockfd, buff, size, 0, (struct sockaddr*)&dst, sizeof(dst)) == (ssize_t)size) {
+            sent++;
+        }
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / (double)NSEC_PER_SEC);
+
+    printf("sent %ld of %ld %lu byte packets to %s:%d in %.3f s (%.0f packets/s)\n", sent, count, size,
+           addr.c_str(), vcm->port, elapsed, elapsed > 0 ? sent / elapsed : 0);
+
+    delete[] buff;
+    close(sockfd);
+    return 0;
+}
@@ -4,8 +4,23 @@
 
 using namespace vcm;
 
-int main() {
-    VCM vcm;
+// prints what the VCM parsed from a config file
+// use as test [path_to_config_file] (current default used otherwise)
+// shared_byte.config covers bit packed measurements that share a byte, its shared memory endianness
+// has to be the receiver's
+int main(int argc, char* argv[]) {
+    VCM* loaded;
+    try {
+        if(argc > 1) {
+            loaded = new VCM(std::string(argv[1])); // use specified config file
+        } else {
+            loaded = new VCM(); // use default config file
+        }
+    } catch(const std::runtime_error* e) {
+        std::cout << e->what() << '\n';
+        return -1;
+    }
+    VCM& vcm = *loaded;
 
     std::cout << "device id: " << vcm.device << '\n';
 
@@ -23,6 +38,13 @@ int main() {
         std::cout << "big endian\n";
     }
 
+    std::cout << "shared memory endianness: ";
+    if(vcm.shm_endianness == GSW_LITTLE_ENDIAN) {
+        std::cout << "little endian\n";
+    } else if(vcm.shm_endianness == GSW_BIG_ENDIAN) {
+        std::cout << "big endian\n";
+    }
+
     std::cout << '\n';
 
     for (auto& it : vcm.measurements) {
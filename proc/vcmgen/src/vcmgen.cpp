@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <iostream>
+#include <string>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include "lib/vcm/vcm.h"
+#include "lib/dls/dls.h"
+#include "common/types.h"
+
+// generates a header describing a config file's packet layout at compile time (see lib/vcm/layout.h)
+// every measurement becomes a type in a namespace named after the device, e.g. spica_v1::GPS_LAT::get(packet)
+// the whole packet is also a packed struct, spica_v1::packet_t, unless measurements share bytes
+// option -f argument to specify VCM config file (current default used otherwise)
+// option -o argument to specify the header to write (required)
+// use as vcmgen [-f path_to_config_file] -o path_to_header
+//
+// names that aren't valid C++ identifiers have every other character replaced with '_'
+
+using namespace vcm;
+using namespace dls;
+
+// turn 'name' into a valid C++ identifier
+std::string identifier(const std::string& name) {
+    std::string id = name;
+    for(size_t i = 0; i < id.size(); i++) {
+        if(!isalnum((unsigned char)id[i]) && id[i] != '_') {
+            id[i] = '_';
+        }
+    }
+
+    if(id.size() == 0 || isdigit((unsigned char)id[0])) {
+        id = "_" + id;
+    }
+
+    return id;
+}
+
+// C++ type that holds 'info' exactly, or "" if there isn't one
+std::string field_type(measurement_info_t* info) {
+    // padded measurements don't line up with a whole type
+    if(info->l_padding || info->r_padding) {
+        return "";
+    }
+
+    if(info->type == INT_TYPE) {
+        switch(info->size) {
+            case 1:
+            case 2:
+            case 4:
+            case 8:
+                return std::string(info->sign == SIGNED_TYPE ? "int" : "uint") + std::to_string(info->size * 8) + "_t";
+            default:
+                return "";
+        }
+    } else if(info->type == FLOAT_TYPE) {
+        if(info->size == sizeof(float)) {
+            return "float";
+        } else if(info->size == sizeof(double)) {
+            return "double";
+        }
+    }
+
+    return "";
+}
+
+// write a packed struct with a member for every measurement, in the receiver's endianness
+// returns false if measurements overlap, a struct can't describe that
+bool write_struct(FILE* out, VCM* vcm) {
+    std::vector<handle_t> order;
+    for(size_t i = 0; i < vcm->measurements.size(); i++) {
+        order.push_back((handle_t)i);
+    }
+    std::stable_sort(order.begin(), order.end(), [vcm](handle_t a, handle_t b) {
+        return vcm->get_info(a)->addr < vcm->get_info(b)->addr;
+    });
+
+    size_t end = 0;
+    for(handle_t i : order) {
+        measurement_info_t* info = vcm->get_info(i);
+        if((size_t)info->addr < end) {
+            return false;
+        }
+        end = (size_t)info->addr + info->size;
+    }
+
+    fprintf(out, "\n    // the whole packet, members are in the receiver's endianness so read them with the types above\n");
+    fprintf(out, "    // unless it's the same as the system's\n");
+    fprintf(out, "    struct __attribute__((packed)) packet_t {\n");
+
+    end = 0;
+    for(handle_t i : order) {
+        measurement_info_t* info = vcm->get_info(i);
+        std::string id = identifier(vcm->measurements[i]);
+        std::string type = field_type(info);
+
+        if((size_t)info->addr > end) {
+            fprintf(out, "        unsigned char _pad%lu[%lu];\n", end, (size_t)info->addr - end);
+        }
+
+        if(type != "") {
+            fprintf(out, "        %s %s;\n", type.c_str(), id.c_str());
+        } else {
+            fprintf(out, "        unsigned char %s[%lu];\n", id.c_str(), info->size);
+        }
+        end = (size_t)info->addr + info->size;
+    }
+
+    if(vcm->packet_size > end) {
+        fprintf(out, "        unsigned char _pad%lu[%lu];\n", end, vcm->packet_size - end);
+    }
+
+    fprintf(out, "    };\n\n");
+    fprintf(out, "    static_assert(sizeof(packet_t) == packet_size, \"packet_t is the wrong size\");\n");
+    for(handle_t i : order) {
+        std::string id = identifier(vcm->measurements[i]);
+        fprintf(out, "    static_assert(offsetof(packet_t, %s) == %s::offset, \"%s is in the wrong place\");\n",
+                id.c_str(), id.c_str(), id.c_str());
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    MsgLogger logger("VCMGEN");
+
+    std::string config_file = "";
+    std::string out_file = "";
+
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-f") || !strcmp(argv[i], "-o")) {
+            if(i + 1 >= argc) {
+                printf("Must specify a path after using the %s option\n", argv[i]);
+                return -1;
+            }
+
+            if(!strcmp(argv[i], "-f")) {
+                config_file = argv[++i];
+            } else {
+                out_file = argv[++i];
+            }
+        } else {
+            printf("Invalid argument: %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if(out_file == "") {
+        printf("Must specify a header to write with the -o option\n");
+        return -1;
+    }
+
+    VCM* vcm;
+    try {
+        if(config_file == "") {
+            vcm = new VCM(); // use default config file
+        } else {
+            vcm = new VCM(config_file); // use specified config file
+        }
+    } catch (const std::runtime_error& e) {
+        std::cout << e.what() << '\n';
+        return -1;
+    }
+
+    std::string ns = identifier(vcm->device);
+
+    // two names can turn into the same identifier, or the same as something generated for the whole packet
+    std::set<std::string> ids = {"device", "packet_size", "endianness", "layout_hash", "packet_t", "check"};
+    for(std::string& name : vcm->measurements) {
+        if(!ids.insert(identifier(name)).second) {
+            printf("Measurement %s has the same C++ name as another measurement or a generated name\n", name.c_str());
+            return -1;
+        }
+    }
+
+    FILE* out = fopen(out_file.c_str(), "w");
+    if(!out) {
+        std::string msg = "Failed to open header: " + out_file;
+        logger.log_message(msg.c_str());
+        printf("Failed to open header: %s\n", out_file.c_str());
+        return -1;
+    }
+
+    const char* endianness = vcm->shm_endianness == GSW_BIG_ENDIAN ? "vcm::GSW_BIG_ENDIAN" : "vcm::GSW_LITTLE_ENDIAN";
+
+    std::string guard = ns + "_LAYOUT_H";
+    for(char& c : guard) {
+        c = toupper((unsigned char)c);
+    }
+
+    fprintf(out, "// generated by vcmgen from %s, do not edit\n", vcm->config_file.c_str());
+    fprintf(out, "#ifndef %s\n", guard.c_str());
+    fprintf(out, "#define %s\n\n", guard.c_str());
+    fprintf(out, "#include \"lib/vcm/layout.h\"\n\n");
+    fprintf(out, "namespace %s {\n", ns.c_str());
+    fprintf(out, "    constexpr const char* device = \"%s\";\n", vcm->device.c_str());
+    fprintf(out, "    constexpr size_t packet_size = %lu;\n", vcm->packet_size);
+    fprintf(out, "    constexpr vcm::endianness_t endianness = %s;\n", endianness);
+    fprintf(out, "    constexpr uint64_t layout_hash = 0x%016lxULL;\n\n", vcm->layout_hash());
+
+    for(size_t i = 0; i < vcm->measurements.size(); i++) {
+        measurement_info_t* info = vcm->get_info((handle_t)i);
+        std::string id = identifier(vcm->measurements[i]);
+        std::string type = field_type(info);
+
+        if(type != "") {
+            fprintf(out, "    typedef vcm::layout::field<%s, %lu, %s> %s;\n", type.c_str(),
+                    (size_t)info->addr, endianness, id.c_str());
+        } else {
+            fprintf(out, "    typedef vcm::layout::bytes<%lu, %lu> %s;\n", (size_t)info->addr,
+                    info->size, id.c_str());
+        }
+    }
+
+    if(!write_struct(out, vcm)) {
+        fprintf(out, "\n    // measurements share bytes, so there's no packed struct for this layout\n");
+    }
+
+    fprintf(out, "\n    // SUCCESS if 'vcm' was loaded from a config file with the same layout as this header\n");
+    fprintf(out, "    inline RetType check(vcm::VCM* vcm) {\n");
+    fprintf(out, "        return vcm::layout::check(vcm, layout_hash);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "}\n\n");
+    fprintf(out, "#endif\n");
+
+    if(fclose(out) != 0) {
+        printf("Failed to write header: %s\n", out_file.c_str());
+        return -1;
+    }
+
+    return 0;
+}